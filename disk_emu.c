@@ -1,24 +1,317 @@
 #include <stdio.h>
-#include <stdlib.h> 
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include "disk_emu.h"
 
 
 FILE* fp = NULL;
-double L, p;
-double r;
-int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY;
+int BLOCK_SIZE, MAX_BLOCK;
+
+/*Memory mapped disk image, NULL when the stdio backend is used*/
+char* disk_map = NULL;
+size_t disk_map_size = 0;
+
+/*Max segments gathered into one preadv/pwritev call*/
+#define DISK_IOV_MAX 64
+
+/*Serializes the fseek/fread/fwrite sequences on the shared FILE*/
+pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*Device model, its state and counters are guarded by model_lock*/
+disk_model_t disk_model;
+disk_stats_t disk_stats;
+int disk_model_set = 0;
+int disk_head = 0;
+unsigned int disk_seed = 1;
+pthread_mutex_t model_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*------------------------------------------------------------------*/
+/*Reads one parameter of the device model from the environment      */
+/*------------------------------------------------------------------*/
+static void model_env(const char *name, double *value)
+{
+    char *s = getenv(name);
+    if (s != NULL)
+    {
+        *value = atof(s);
+    }
+}
+
+static void model_env_int(const char *name, int *value)
+{
+    char *s = getenv(name);
+    if (s != NULL)
+    {
+        *value = atoi(s);
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Sets the device model from the environment.                       */
+/*SFS_DISK_MODEL=hdd or ssd selects a preset, the other variables   */
+/*override single parameters. Without them the device is free.      */
+/*------------------------------------------------------------------*/
+static void load_disk_model()
+{
+    disk_model_t *m = &disk_model;
+    char *preset = getenv("SFS_DISK_MODEL");
+
+    memset(m, 0, sizeof(*m));
+    m->queue_depth = 1;
+    m->sleep = 1;
+
+    if (preset != NULL && strcmp(preset, "hdd") == 0)
+    {
+        /*7200 rpm disk, 100 MB/s*/
+        m->seek_time = 4000;
+        m->seek_per_block = 0.5;
+        m->seek_max = 12000;
+        m->read_latency = 100;
+        m->write_latency = 100;
+        m->transfer_time = 10;
+        m->queue_depth = 1;
+    }
+    else if (preset != NULL && strcmp(preset, "ssd") == 0)
+    {
+        /*SATA flash disk, 500 MB/s*/
+        m->read_latency = 80;
+        m->write_latency = 30;
+        m->transfer_time = 2;
+        m->queue_depth = 32;
+    }
+
+    model_env("SFS_DISK_SEEK_US", &m->seek_time);
+    model_env("SFS_DISK_SEEK_PER_BLOCK_US", &m->seek_per_block);
+    model_env("SFS_DISK_SEEK_MAX_US", &m->seek_max);
+    model_env("SFS_DISK_READ_US", &m->read_latency);
+    model_env("SFS_DISK_WRITE_US", &m->write_latency);
+    model_env("SFS_DISK_XFER_US", &m->transfer_time);
+    model_env_int("SFS_DISK_QDEPTH", &m->queue_depth);
+    model_env("SFS_DISK_FAIL_PROB", &m->fail_prob);
+    model_env_int("SFS_DISK_MAX_RETRY", &m->max_retry);
+    model_env_int("SFS_DISK_SLEEP", &m->sleep);
+
+    if (m->queue_depth < 1)
+    {
+        m->queue_depth = 1;
+    }
+}
+
+/*------------------------------------------------------------------*/
+/*Replaces the device model, it is kept by later disk initializations*/
+/*------------------------------------------------------------------*/
+void set_disk_model(const disk_model_t *model)
+{
+    pthread_mutex_lock(&model_lock);
+    disk_model = *model;
+    if (disk_model.queue_depth < 1)
+    {
+        disk_model.queue_depth = 1;
+    }
+    disk_model_set = 1;
+    pthread_mutex_unlock(&model_lock);
+}
+
+void get_disk_model(disk_model_t *model)
+{
+    pthread_mutex_lock(&model_lock);
+    *model = disk_model;
+    pthread_mutex_unlock(&model_lock);
+}
+
+void get_disk_stats(disk_stats_t *stats)
+{
+    pthread_mutex_lock(&model_lock);
+    *stats = disk_stats;
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Starts a new device: model from the environment, zero counters    */
+/*------------------------------------------------------------------*/
+static void init_disk_model()
+{
+    pthread_mutex_lock(&model_lock);
+    if (!disk_model_set)
+    {
+        load_disk_model();
+    }
+    memset(&disk_stats, 0, sizeof(disk_stats));
+    disk_head = 0;
+    disk_seed = (unsigned int)time(0);
+    pthread_mutex_unlock(&model_lock);
+}
+
+/*------------------------------------------------------------------*/
+/*Fixed cost of a request at start_address: latency and seek.       */
+/*Called with model_lock held, moves the head past the request.     */
+/*------------------------------------------------------------------*/
+static double model_request(int start_address, int nblocks, int write)
+{
+    disk_model_t *m = &disk_model;
+    double cost = write ? m->write_latency : m->read_latency;
+
+    if (start_address != disk_head)
+    {
+        int dist = abs(start_address - disk_head);
+        double seek = m->seek_time + m->seek_per_block * dist;
+        if (m->seek_max > 0 && seek > m->seek_max)
+        {
+            seek = m->seek_max;
+        }
+        cost += seek;
+        disk_stats.seeks++;
+    }
+    disk_head = start_address + nblocks;
+
+    if (write)
+    {
+        disk_stats.writes++;
+        disk_stats.blocks_written += nblocks;
+    }
+    else
+    {
+        disk_stats.reads++;
+        disk_stats.blocks_read += nblocks;
+    }
+    return cost;
+}
+
+/*------------------------------------------------------------------*/
+/*Charges the modeled device time of a list of segments.            */
+/*Segments adjacent on disk form one request; up to queue_depth     */
+/*requests overlap their fixed costs, transfers are serial.         */
+/*Returns -1 if a request fails more than max_retry times.          */
+/*------------------------------------------------------------------*/
+static int disk_delay(const blkvec_t *vec, int nvec, int write)
+{
+    disk_model_t *m = &disk_model;
+    double fixed = 0, transfer = 0, total;
+    int i, nreq = 0, ret = 0;
+
+    pthread_mutex_lock(&model_lock);
+    i = 0;
+    while (i < nvec)
+    {
+        int first = vec[i].start_address;
+        int next = first;
+        while (i < nvec && vec[i].start_address == next)
+        {
+            next += vec[i].nblocks;
+            i++;
+        }
+
+        double req_fixed = model_request(first, next - first, write);
+        double req_transfer = m->transfer_time * (next - first);
+        fixed += req_fixed;
+        transfer += req_transfer;
+        nreq++;
+
+        /*Failed attempts are repeated, each one costs the whole request*/
+        int attempt = 0;
+        while (m->fail_prob > 0 && (double)rand_r(&disk_seed) / RAND_MAX < m->fail_prob)
+        {
+            if (attempt++ >= m->max_retry)
+            {
+                ret = -1;
+                break;
+            }
+            disk_stats.retries++;
+            fixed += req_fixed;
+            transfer += req_transfer;
+        }
+        if (ret < 0)
+        {
+            break;
+        }
+    }
+
+    total = transfer + fixed / (nreq < m->queue_depth ? nreq : m->queue_depth);
+    disk_stats.busy_time += total;
+    int sleep = m->sleep;
+    pthread_mutex_unlock(&model_lock);
+
+    /*Pause until the latency duration is elapsed*/
+    if (sleep && total >= 1)
+    {
+        usleep((useconds_t)total);
+    }
+    return ret;
+}
+
+/*------------------------------------------------------------------*/
+/*Maps the opened disk file into memory.                            */
+/*Setting SFS_DISK_BACKEND=stdio in the environment keeps the old   */
+/*fseek/fread/fwrite path; it is also used if mmap is not possible. */
+/*------------------------------------------------------------------*/
+static void map_disk()
+{
+    char *backend = getenv("SFS_DISK_BACKEND");
+    if (backend != NULL && strcmp(backend, "stdio") == 0)
+    {
+        return;
+    }
+
+    /*Blocks past the end of a short file would fault when touched,*/
+    /*such an image stays on the stdio path                         */
+    struct stat st;
+    if (fstat(fileno(fp), &st) < 0 || (size_t)st.st_size < (size_t)BLOCK_SIZE * MAX_BLOCK)
+    {
+        return;
+    }
+
+    disk_map_size = (size_t)BLOCK_SIZE * MAX_BLOCK;
+    void *map = mmap(NULL, disk_map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+    if (map == MAP_FAILED)
+    {
+        disk_map_size = 0;
+        return;
+    }
+    disk_map = (char *)map;
+}
+
+/*----------------------------------------------------------*/
+/*Flushes written blocks to the disk file.                  */
+/*This is the explicit durability point of the emulator.    */
+/*----------------------------------------------------------*/
+int sync_disk()
+{
+    if (NULL != disk_map)
+    {
+        if (msync(disk_map, disk_map_size, MS_SYNC) < 0)
+        {
+            return -1;
+        }
+    }
+    else if (NULL != fp)
+    {
+        fflush(fp);
+    }
+    return 0;
+}
 
 /*----------------------------------------------------------*/
 /*Close the disk file filled when you don't need it anymore. */
 /*----------------------------------------------------------*/
 int close_disk()
 {
+    if (NULL != disk_map)
+    {
+        msync(disk_map, disk_map_size, MS_SYNC);
+        munmap(disk_map, disk_map_size);
+        disk_map = NULL;
+        disk_map_size = 0;
+    }
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
     }
     return 0;
 }
@@ -30,9 +323,13 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
     int i, j;
 
+    /*Releases a previously opened disk*/
+    close_disk();
+
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+    init_disk_model();
+
     /*Initializes the random number generator*/
     srand((unsigned int)(time( 0 )) );
     /*Creates a new file*/
@@ -43,7 +340,14 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
         printf("Could not create new disk file %s\n\n", filename);
         return -1;
     }
-    
+
+    /*Sizes the file with 0's; a truncated file reads back as zeros*/
+    if (ftruncate(fileno(fp), (off_t)BLOCK_SIZE * MAX_BLOCK) == 0)
+    {
+        map_disk();
+        return 0;
+    }
+
     /*Fills the file with 0's to its given size*/
     for (i = 0; i < MAX_BLOCK; i++)
     {
@@ -59,9 +363,13 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
+    /*Releases a previously opened disk*/
+    close_disk();
+
     BLOCK_SIZE = block_size;
     MAX_BLOCK = num_blocks;
-    
+    init_disk_model();
+
     /*Opens a file*/
     fp = fopen (filename, "r+b");
 
@@ -70,6 +378,8 @@ int init_disk(char *filename, int block_size, int num_blocks)
         printf("Could not open %s\n\n", filename);
         return -1;
     }
+
+    map_disk();
     return 0;
 }
 
@@ -81,9 +391,6 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -91,6 +398,21 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
+    blkvec_t vec = { start_address, nblocks, buffer };
+    if (disk_delay(&vec, 1, 0) < 0)
+    {
+        return -1;
+    }
+
+    /*Mapped disk: the blocks are copied straight from the image*/
+    if (NULL != disk_map)
+    {
+        memcpy(buffer, disk_map + (size_t)start_address * BLOCK_SIZE, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+
     /*Goto the data requested from the disk*/
     fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
 
@@ -98,11 +420,10 @@ int read_blocks(int start_address, int nblocks, void *buffer)
     for (i = 0; i < nblocks; ++i)
     {
         s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-        memcpy((char *)buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
+        fread((char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE, 1, fp);
     }
 
-    free(blockRead);
+    pthread_mutex_unlock(&disk_lock);
     return s;
 }
 
@@ -114,8 +435,6 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     int i, s;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -123,21 +442,121 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
+    blkvec_t vec = { start_address, nblocks, buffer };
+    if (disk_delay(&vec, 1, 1) < 0)
+    {
+        return -1;
+    }
+
+    /*Mapped disk: the blocks are copied straight into the image,*/
+    /*they reach the file at the next sync_disk() or close_disk() */
+    if (NULL != disk_map)
+    {
+        memcpy(disk_map + (size_t)start_address * BLOCK_SIZE, buffer, (size_t)nblocks * BLOCK_SIZE);
+        return nblocks;
+    }
+
+    pthread_mutex_lock(&disk_lock);
+
+    /*Goto where the data is to be written on the disk*/
     fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
 
-    /*For every block requested*/        
+    /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
-        /*Pause until the latency duration is elapsed*/
-        usleep(L);
+        fwrite((char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE, 1, fp);
+        fflush(fp);
+        s++;
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return s;
+}
+
+/*------------------------------------------------------------------*/
+/*Transfers a list of segments between the disk and memory.         */
+/*Segments that follow each other on disk are gathered into a       */
+/*single preadv/pwritev call, whatever their memory buffers are.    */
+/*------------------------------------------------------------------*/
+static int transfer_blocks_v(const blkvec_t *vec, int nvec, int write)
+{
+    struct iovec iov[DISK_IOV_MAX];
+    int i, niov, first, next;
+    int s = 0;
+
+    /*Checks that all the segments are within the range of addresses of the disk*/
+    for (i = 0; i < nvec; i++)
+    {
+        if (vec[i].start_address < 0 || vec[i].start_address + vec[i].nblocks > MAX_BLOCK)
+        {
+            printf("out of bound error %d\n", vec[i].start_address);
+            return -1;
+        }
+        s += vec[i].nblocks;
+    }
+
+    if (disk_delay(vec, nvec, write) < 0)
+    {
+        return -1;
+    }
+
+    /*Mapped disk: every segment is a direct copy*/
+    if (NULL != disk_map)
+    {
+        for (i = 0; i < nvec; i++)
+        {
+            char *blk = disk_map + (size_t)vec[i].start_address * BLOCK_SIZE;
+            size_t len = (size_t)vec[i].nblocks * BLOCK_SIZE;
+            if (write) memcpy(blk, vec[i].buffer, len);
+            else memcpy(vec[i].buffer, blk, len);
+        }
+        return s;
+    }
+
+    /*For every run of segments adjacent on disk*/
+    i = 0;
+    while (i < nvec)
+    {
+        first = next = vec[i].start_address;
+        niov = 0;
+        while (i < nvec && niov < DISK_IOV_MAX && vec[i].start_address == next)
+        {
+            iov[niov].iov_base = vec[i].buffer;
+            iov[niov].iov_len = (size_t)vec[i].nblocks * BLOCK_SIZE;
+            next += vec[i].nblocks;
+            niov++;
+            i++;
+        }
 
-        memcpy(blockWrite, (char *)buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
+        off_t pos = (off_t)first * BLOCK_SIZE;
+        ssize_t len = write ? pwritev(fileno(fp), iov, niov, pos) : preadv(fileno(fp), iov, niov, pos);
+        if (len != (ssize_t)(next - first) * BLOCK_SIZE)
+        {
+            return -1;
+        }
+    }
 
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
+    /*Drops stdio buffered data made stale by the direct writes*/
+    if (write)
+    {
+        pthread_mutex_lock(&disk_lock);
         fflush(fp);
-        s++;
+        pthread_mutex_unlock(&disk_lock);
     }
-    free(blockWrite);
     return s;
 }
+
+/*-------------------------------------------------------------------*/
+/*Reads a list of block segments from the disk                       */
+/*-------------------------------------------------------------------*/
+int read_blocks_v(const blkvec_t *vec, int nvec)
+{
+    return transfer_blocks_v(vec, nvec, 0);
+}
+
+/*------------------------------------------------------------------*/
+/*Writes a list of block segments to the disk                       */
+/*------------------------------------------------------------------*/
+int write_blocks_v(const blkvec_t *vec, int nvec)
+{
+    return transfer_blocks_v(vec, nvec, 1);
+}
@@ -1,5 +1,51 @@
+#ifndef DISK_EMU_H
+#define DISK_EMU_H
+
+/*One scatter/gather segment: nblocks consecutive disk blocks at start_address*/
+typedef struct {
+    int start_address;
+    int nblocks;
+    void *buffer;
+} blkvec_t;
+
+/*Device timing model, all times are in microseconds.                */
+/*It is read from the SFS_DISK_* environment variables when the disk */
+/*is initialized, unless set_disk_model() was called before.         */
+typedef struct {
+    double seek_time;       /*cost of a request not starting where the previous one ended*/
+    double seek_per_block;  /*additional seek cost per block of head travel*/
+    double seek_max;        /*upper bound of the seek cost, 0 for none*/
+    double read_latency;    /*fixed cost of a read request*/
+    double write_latency;   /*fixed cost of a write request*/
+    double transfer_time;   /*cost of every transferred block*/
+    int queue_depth;        /*requests of one vectored call overlapping their fixed costs*/
+    double fail_prob;       /*probability of a failed attempt, which is retried*/
+    int max_retry;          /*retries before the request returns an error*/
+    int sleep;              /*not 0: callers wait for the modeled time*/
+} disk_model_t;
+
+/*Device counters since the disk was initialized*/
+typedef struct {
+    long reads;
+    long writes;
+    long blocks_read;
+    long blocks_written;
+    long seeks;
+    long retries;
+    double busy_time;       /*modeled device time*/
+} disk_stats_t;
+
+void set_disk_model(const disk_model_t *model);
+void get_disk_model(disk_model_t *model);
+void get_disk_stats(disk_stats_t *stats);
+
 int init_fresh_disk(char *filename, int block_size, int num_blocks);
 int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
+int read_blocks_v(const blkvec_t *vec, int nvec);
+int write_blocks_v(const blkvec_t *vec, int nvec);
 int close_disk();
+int sync_disk();
+
+#endif
@@ -9,10 +9,82 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include "disk_emu.h"
 #include "sfs_api.h"
 
+/* Files opened through FUSE. SFS allows one descriptor per file,  */
+/* so handles of the same file share it; fi->fh keeps the slot index */
+#define MAX_OPEN_FILES 16
+
+typedef struct {
+    char name[MAXFILENAME+1];
+    int fd;
+    int refcnt;
+} open_file_t;
+
+static open_file_t open_files[MAX_OPEN_FILES];
+static pthread_mutex_t open_files_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int open_file_find(const char *name)
+{
+    int i;
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].refcnt > 0 && strcmp(open_files[i].name, name) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* opens (or creates) file once and returns its slot */
+static int open_file_get(const char *name)
+{
+    int i, fd;
+    
+    if (strlen(name) > MAXFILENAME)
+        return -ENAMETOOLONG;
+    
+    pthread_mutex_lock(&open_files_lock);
+    i = open_file_find(name);
+    if (i >= 0) {
+        open_files[i].refcnt++;
+        pthread_mutex_unlock(&open_files_lock);
+        return i;
+    }
+    
+    for (i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].refcnt == 0)
+            break;
+    }
+    if (i >= MAX_OPEN_FILES) {
+        pthread_mutex_unlock(&open_files_lock);
+        return -EMFILE;
+    }
+    
+    fd = sfs_fopen((char *)name);
+    if (fd == -1) {
+        pthread_mutex_unlock(&open_files_lock);
+        return -EIO;
+    }
+    
+    strcpy(open_files[i].name, name);
+    open_files[i].fd = fd;
+    open_files[i].refcnt = 1;
+    pthread_mutex_unlock(&open_files_lock);
+    return i;
+}
+
+/* closes file when its last handle is released */
+static void open_file_put(int i)
+{
+    pthread_mutex_lock(&open_files_lock);
+    if (--open_files[i].refcnt == 0)
+        sfs_fclose(open_files[i].fd);
+    pthread_mutex_unlock(&open_files_lock);
+}
+
 static int fuse_getattr(const char *path, struct stat *stbuf)
 {
     int res = 0;
@@ -67,81 +139,85 @@ static int fuse_unlink(const char *path)
 static int fuse_open(const char *path, struct fuse_file_info *fi)
 {
     int res;
-    char filename[MAXFILENAME];
     
-    strcpy(filename, path);
+    res = open_file_get(path);
+    if (res < 0)
+        return res;
     
-    res = sfs_fopen(filename);
-    if (res == -1)
-        return -errno;
-    
-    sfs_fclose(res);
+    fi->fh = res;
     return 0;
 }
 
 static int fuse_read(const char *path, char *buf, size_t size, off_t offset,
         struct fuse_file_info *fi)
 {
-    int fd;
-    int res;
-    
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
+    /* sfs positions are int, no file reaches past INT_MAX */
+    if (offset < 0)
+        return -EINVAL;
+    if (offset >= INT_MAX)
+        return 0;
+    if (size > (size_t)(INT_MAX - offset))
+        size = INT_MAX - offset;
     
-    fd = sfs_fopen(filename);
-    if (fd == -1)
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
-    
-    res = sfs_fread(fd, buf, size);
-    if (res == -1)
-        return -errno;
-    
-    sfs_fclose(fd);
-    return res;
+    return sfs_pread(open_files[fi->fh].fd, buf, size, offset);
 }
 
 static int fuse_write(const char *path, const char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    int fd;
     int res;
     
-    char filename[MAXFILENAME];
-    
-    strcpy(filename, path);
-    
-    fd = sfs_fopen(filename);
-    if (fd == -1) 
-        return -errno;
-    
-    if(sfs_fseek(fd, offset) == -1)
-        return -errno;
+    if (offset < 0)
+        return -EINVAL;
+    if (offset > INT_MAX || size > (size_t)(INT_MAX - offset))
+        return -EFBIG;
     
-    res = sfs_fwrite(fd, buf, size);
-    if (res == -1)
-        return -errno;
+    res = sfs_pwrite(open_files[fi->fh].fd, buf, size, offset);
+    if (res == 0 && size > 0)
+        return -ENOSPC;
     
-    sfs_fclose(fd);
     return res;
 }
 
 static int fuse_truncate(const char *path, off_t size)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    char filename[MAXFILENAME+1];
+    int fd, i, res;
     
+    if (size < 0 || size > INT_MAX)
+        return -EFBIG;
+    if (strlen(path) > MAXFILENAME)
+        return -ENAMETOOLONG;
     strcpy(filename, path);
     
-    fd = sfs_remove(filename);
-    if (fd == -1)
-        return -errno;
+    /* the file is cut in place, an open file keeps its descriptor */
+    pthread_mutex_lock(&open_files_lock);
+    i = open_file_find(filename);
+    if (i >= 0) {
+        res = sfs_ftruncate(open_files[i].fd, size);
+    } else if (sfs_getfilesize(filename) == -1) {
+        pthread_mutex_unlock(&open_files_lock);
+        return -ENOENT;
+    } else {
+        fd = sfs_fopen(filename);
+        res = sfs_ftruncate(fd, size);
+        sfs_fclose(fd);
+    }
+    pthread_mutex_unlock(&open_files_lock);
+    return (res < 0) ? -EIO : 0;
+}
+
+static int fuse_release(const char *path, struct fuse_file_info *fi)
+{
+    open_file_put(fi->fh);
+    return 0;
+}
+
+static int fuse_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    if (sfs_sync() == -1)
+        return -EIO;
     
-    fd = sfs_fopen(filename);
-    sfs_fclose(fd);
     return 0;
 }
 
@@ -155,15 +231,15 @@ static int fuse_mknod(const char *path, mode_t mode, dev_t rdev)
     return 0;
 }
 
-static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fp)
+static int fuse_create (const char *path, mode_t mode, struct fuse_file_info *fi)
 {
-    char filename[MAXFILENAME];
-    int fd;
+    int res;
     
-    strcpy(filename, path);
-    fd = sfs_fopen(filename);
+    res = open_file_get(path);
+    if (res < 0)
+        return res;
     
-    sfs_fclose(fd);
+    fi->fh = res;
     return 0;
 }
 
@@ -176,6 +252,8 @@ static struct fuse_operations xmp_oper = {
     .open = fuse_open, 
     .read = fuse_read, 
     .write = fuse_write, 
+    .release = fuse_release,
+    .fsync = fuse_fsync,
     .access = fuse_access,
     .create = fuse_create,
 };
@@ -1,11 +1,13 @@
 #ifndef SFS_H
 #define SFS_H
 
+#include "disk_emu.h"
 
 // types for sfs project
 typedef unsigned char byte_t;
-typedef short int inode_t;
-typedef short int block_t;
+typedef int inode_t;
+typedef int block_t;
+typedef short int blkptr_t;		// block pointer of SFS_VERSION_BLKPTR map
 typedef int dir_t;
 typedef unsigned int bitmap_t;
 
@@ -14,8 +16,8 @@ typedef unsigned int bitmap_t;
 
 #define BLOCK_SIZE			1024
 
-// filesystem size in blocks
-// 8MB or less
+// default filesystem size in blocks, mksfs_opts sets other sizes
+// 8MB
 #define MAX_FS_SIZE			(1024*8)
 
 // disk structures item sizes
@@ -23,17 +25,19 @@ typedef unsigned int bitmap_t;
 #define INODE_ENTRY_SIZE	256
 
 #define INODES_PER_BLOCK	(BLOCK_SIZE / INODE_ENTRY_SIZE)
-#define BLKPTR_PER_BLOCK	(BLOCK_SIZE / sizeof(block_t))
+#define BLKPTR_PER_BLOCK	(BLOCK_SIZE / sizeof(blkptr_t))
 
 // 1% of disk size for file metadata
 // max inodes = max files on disk
 // MAX_FS_SIZE * INODES_PER_BLOCK / 100   ~327   81 blocks    81*4=324
 #define MAX_INODES			324
-// inodes table max size in blocks
+// inodes table max size in blocks of default image and of SFS_VERSION_BLKPTR / SFS_VERSION_EXTENT images
 #define MAX_INODE_BLOCKS	(MAX_INODES / INODES_PER_BLOCK)
 
 // max block item in freemap block
 #define MAX_FREEMAP_ID		(BLOCK_SIZE / sizeof(bitmap_t))
+// blocks described by one freemap block
+#define FREEMAP_BLOCK_BITS	(MAX_FREEMAP_ID * 32)
 
 //#define MAX_FNAME_LENGTH	(DIR_ENTRY_SIZE - sizeof(inode_t))
 #define MAX_FNAME_LENGTH	32
@@ -41,15 +45,49 @@ typedef unsigned int bitmap_t;
 
 // max file descriptors
 #define MAX_FD 				16
-// max blocks in file system
+// max blocks in file system of SFS_VERSION_BLKPTR / SFS_VERSION_EXTENT images
 #define MAX_BLOCK			(MAX_FS_SIZE - 1 - 81 - 1)
 
 // superblock params
 #define SB_MAGIC			0xACBD0005
 
+// on-disk format versions, images made before the version field have 0 there
+#define SFS_VERSION_BLKPTR	0	// inode keeps block pointers, chained pointer blocks
+#define SFS_VERSION_EXTENT	1	// inode keeps extents, chained extent blocks
+#define SFS_VERSION_LARGE	2	// as SFS_VERSION_EXTENT, 32 bit inode numbers in directory,
+								// size of inode table & freemap chosen by mksfs
+#define SFS_VERSION_TREE	3	// as SFS_VERSION_LARGE, extents blocks are found through index tree
+// format of new images
+#ifndef SFS_VERSION
+#define SFS_VERSION			SFS_VERSION_TREE
+#endif
+
+// blocks of block cache, dirty ones are committed together
+#define BC_BLOCKS			128
+// cache grows up to it when operations in progress dirty all its blocks, journal takes that many
+#define BC_MAX_BLOCKS		(2 * BC_BLOCKS)
+
+// metadata journal, follows freemap blocks: header block, descriptor blocks, transaction blocks
+// legacy layout has no journal
+#define JOURNAL_MAGIC		0x4A524E4C
+// home block numbers in header block, descriptor blocks continue the list
+#define JOURNAL_MAX_BLOCKS	((BLOCK_SIZE - 4 * sizeof(int)) / sizeof(int))
+
+// free blocks are counted per group of blocks, group is 32 free map words or its power of 2 multiple
+#define FM_GROUP_BLOCKS		1024
+#define SB_MAX_GROUPS		192
+
+// extents in inode record and in one extents block
+#define INODE_EXTENTS		18
+#define BLOCK_EXTENTS		((BLOCK_SIZE - sizeof(int)) / sizeof(Extent))
+// children of extents index block
+#define INDEX_ENTRIES		((BLOCK_SIZE - 2 * sizeof(int)) / sizeof(IndexEntry))
+
 // markers for free elements
 #define INODE_FREE			-1
 #define BLOCK_FREE			-1
+// file block without data block, it reads as zeros
+#define BLOCK_HOLE			-2
 
 
 
@@ -62,9 +100,73 @@ typedef struct {
 	int fssize;
 	int inodeBlks;
 	int inodeRoot;
-	int padding[251];
+	int version;			// on-disk format, SFS_VERSION_*
+	int journalStart;		// first block of journal
+	int journalBlks;		// journal size in blocks, 0 if there is no journal
+	int freeBlocks;			// free blocks at last commit
+	int groups;				// number of groups in groupFree, 0 if free map was not counted
+	int groupFree[SB_MAX_GROUPS];	// free blocks of each group at last commit
+	int freemapStart;		// first block of free map, 0 in images with 1 freemap block after inodes
+	int freemapBlks;		// free map size in blocks
+	int groupBlocks;		// blocks of group, 0 for FM_GROUP_BLOCKS
+	int inodemapStart;		// first block of inode bitmap, follows journal
+	int inodemapBlks;		// inode bitmap size in blocks, 0 if image has none
+	int padding[49];
 } SuperBlock;
 
+// journal header, describes last committed transaction
+// list of home blocks continues in descriptor blocks after the header if it is longer
+typedef struct {
+	int magic;				// JOURNAL_MAGIC if transaction was written
+	int seq;				// transaction number
+	int count;				// blocks in transaction, 0 after checkpoint
+	unsigned int checksum;	// of header & blocks, torn transaction does not match
+	int blocks[JOURNAL_MAX_BLOCKS];	// home blocks of transaction blocks
+} JournalHeader;
+
+// run of data blocks
+typedef struct {
+	int lblk;				// first file block
+	int start;				// first data block, relative to first_data_block var
+	int len;				// number of blocks
+} Extent;
+
+// inode block map - SFS_VERSION_BLKPTR
+typedef struct {
+	blkptr_t blocks[115]; 	// blocks of inode, relative to first_data_block var
+	blkptr_t next;			// block with next inode blocks
+} BlkPtrMap;
+
+// inode block map - SFS_VERSION_EXTENT
+typedef struct {
+	int count;				// extents of file
+	Extent ext[INODE_EXTENTS];	// first extents of file
+	int next;				// block with next extents
+	int index;				// root of extents blocks index - SFS_VERSION_TREE
+	int padding;
+} ExtentMap;
+
+// extents block, continues inode extents
+typedef struct {
+	Extent ext[BLOCK_EXTENTS];
+	int next;				// block with next extents
+} ExtentBlock;
+
+// child of extents index block
+typedef struct {
+	int lblk;				// first file block mapped by child
+	int blk;				// child block
+} IndexEntry;
+
+// extents index block - SFS_VERSION_TREE
+// extents blocks are children of level 0 blocks, index blocks of level - 1 are children of others
+// blocks are filled in order, so child i of level L block maps extents blocks from i * INDEX_ENTRIES^L
+typedef struct {
+	int level;
+	int count;				// used entries
+	IndexEntry ent[INDEX_ENTRIES];
+} ExtentIndex;
+
 // inodes table
 typedef struct {
 	int used;				// not 0 if inode inused
@@ -73,75 +175,253 @@ typedef struct {
 	int uid;				// to be "unix-like" - not using
 	int gid;				// to be "unix-like" - not using
 	int size;				// file size
-	block_t blocks[115]; 	// blocks of inode, relative to first_data_block var
-	block_t next;			// block with next inode blocks
+	union {
+		BlkPtrMap ptr;
+		ExtentMap ext;
+	} map;					// blocks of file, format depends on sblock.version
 } INode;
 
 // root directory items
+// images before SFS_VERSION_LARGE keep 16 bit inode there, following 2 bytes are padding
 typedef struct {
 	char filename[MAX_FNAME_LENGTH+1];
 	inode_t inode;
         char padding[DIR_ENTRY_SIZE - (MAX_FNAME_LENGTH + 1) - sizeof(inode_t)];
 } DirEntry;
 
+// in-memory inode, fields checked on every access are kept apart from block map of record
+typedef struct {
+	int used;				// copy of record used
+	int size;				// copy of record size, record is updated by i_update
+	int gen;				// block map generation
+} INodeMem;
+
 // open file table item
 typedef struct {
 	inode_t inode;	// equals INODE_FREE if entry is free
 	int iopos;		// position in file
+	// readahead of sequential reads
+	int ra_next;	// position which continues last read, -1 if unknown
+	int ra_window;	// blocks read ahead, 0 for random reads
+	int ra_start;	// file position of readahead buffer
+	int ra_len;		// bytes in readahead buffer
+	char *ra_buf;
+	// buffer of sequential writes, their blocks are allocated when it is flushed
+	int wb_pos;		// file position of write buffer
+	int wb_len;		// bytes in write buffer, 0 if it is empty
+	int wb_cap;		// size of wb_buf
+	int wb_resv;	// blocks reserved for buffered data past end of file
+	char *wb_buf;
 } FileDesc;
 
 #pragma pack(pop)
 
 // disk structures
 extern SuperBlock sblock;
-extern INode inodes[MAX_INODES];
 extern DirEntry *root;
-extern bitmap_t freemap[MAX_FREEMAP_ID];
+extern bitmap_t *freemap;				// sblock.freemapBlks blocks
 
 // file search state
 extern int last_search_index;
 
+// open file table
+extern FileDesc ofdt[MAX_FD];
+
 // misc tools
 //extern inode_t last_inode_block;
-extern block_t freemap_freeblocks;	// number of free blocks
-extern block_t freemap_block; 		// free map is not greater than 1 block 1KB
+extern int freemap_freeblocks;		// number of free blocks
 extern block_t first_data_block;
 
 // root directory
+// bytes of root directory, -1 if root inode is not loaded
+extern int dir_size();
 // get root item by fname
 extern int dir_getfileid(const char* fname);
 // get free root item
 extern int dir_getfreeid();
 // write root directory changes to disk
 extern int dir_update(int fid);
+// filename index of root directory
+// rebuilds index from root entries, returns 0 for success and -1 for error
+extern int dir_index_build();
+// adds / removes used root item
+extern void dir_index_add(int fid);
+extern void dir_index_remove(int fid);
 
 // free blocks map - logical blocks
-// allocates nblocks sfs data blocks
-extern block_t* b_alloc(int nblocks);
-// allocates 1 sfs data block
+// allocates nblocks sfs data blocks into free_blocks array
+extern int b_alloc(block_t* free_blocks, int nblocks);
+// allocates 1 sfs data block, returns BLOCK_FREE if disk is full
 extern block_t b_alloc_one();
-// clear block on disk - write zeros
-extern int b_zero(block_t blk);
+// allocates run of up to nblocks contiguous blocks, at goal if it is free
+// returns first block and sets len, BLOCK_FREE if disk is full
+extern block_t b_alloc_run(block_t goal, int nblocks, int *len);
+// returns number of free blocks, reserved ones are not counted
+extern int b_freecount();
+// reserves nblocks free blocks for later allocation if keep free blocks stay after them
+// reserved blocks are allocated after b_unreserve, returns 0 for success and -1 if disk is full
+extern int b_reserve(int nblocks, int keep);
+extern void b_unreserve(int nblocks);
 // marks block as unused - free it
 extern int b_free(block_t block);
-// write free map changes to disk
-extern int fm_update();
+// frees run of blocks
+extern int b_free_run(block_t start, int len);
+// rebuilds allocator summary of free map and free blocks counter, called after free map is loaded
+// counts of superblock are used if they are valid, free map is counted otherwise
+// returns 0 for success and -1 for error
+extern int fm_init();
+// copies free map blocks changed since last snapshot for commit
+// blocks freed before it become free after fm_commit_done
+// returns number of changed blocks, sets buf to the copy and blks to indexes of changed blocks
+// free counts of superblock are updated for changed groups
+extern int fm_snapshot(const bitmap_t **buf, int **blks);
+extern void fm_commit_done();
 
 // inode table
-// allocates 1 sfs inode item
+// inode cache - inode table blocks are loaded on first use, unpinned ones are evicted
+// empties inode cache for sblock.inodeBlks blocks, returns 0 for success and -1 for error
+extern int i_init();
+// pins inode, its record stays resident until i_put
+// returns 0 for success and -1 for error
+extern int i_get(inode_t inode);
+extern void i_put(inode_t inode);
+// in-memory inode of pinned inode, 0 if inode is not resident
+extern INodeMem *i_mem(inode_t inode);
+// record of pinned inode with its block map, 0 if inode is not resident
+// used & size of record are valid after i_update only, i_mem keeps current ones
+extern INode *i_rec(inode_t inode);
+// block map generation of pinned inode, changes with its block map
+extern int i_gen(inode_t inode);
+extern void i_gen_bump(inode_t inode);
+// map blocks chain of pinned inode - pointers blocks or extents blocks following its record
+// known blocks are kept with the record, so lookups do not walk the chain from its start
+// returns chain block cid (0 - first block after record) relative to first_data_block,
+// sets lblk to first file block it maps, BLOCK_FREE if chain is shorter
+extern block_t i_chain(inode_t inode, int cid, int *lblk);
+// block cid is linked to the end of chain
+extern void i_chain_add(inode_t inode, int cid, block_t blk, int lblk);
+// chain blocks are freed
+extern void i_chain_reset(inode_t inode);
+// returns last chain block id of first nblk chain blocks, which maps blocks from lblk <= blkid
+extern int i_chain_find(inode_t inode, int nblk, int blkid);
+// writes empty inode table of new image, root inode is used
+extern int i_format();
+// free inode bitmap - bit is set if inode is used, called with dir_lock held
+// loads bitmap of mounted image, images without it are scanned
+// returns 0 for success and -1 for error
+extern int im_init();
+// writes bitmap of new image, root inode is used
+extern int im_format();
+// returns first free inode and marks it used, -1 if inodes table is full
+extern inode_t im_alloc();
+extern void im_free(inode_t inode);
+// allocates 1 sfs inode item, its record is saved
 extern inode_t i_alloc();
+// resets inode record to empty file
+extern void i_clear(inode_t inode);
 // for given inode searches in inode record and inode pointers blocks
 // for required file offset
 // returns absolute block number by logical file block number(blkid)
+// BLOCK_HOLE if file block has no data block
 extern block_t i_getblk(inode_t inode, int blkid);
+// same as i_getblk, sets len to number of contiguous blocks or hole blocks from blkid
+extern block_t i_getrun(inode_t inode, int blkid, int *len);
+// returns number of hole blocks of file blocks first..last, -1 for error
+extern int i_holes(inode_t inode, int first, int last);
 // reads size bytes from disk to buf from offset for given inode
 extern int i_read(inode_t inode, int offset, char* buf, int size);
 // writes size bytes from buf to disk from offset for given inode
 extern int i_write(inode_t inode, int offset, const char* buf, int size);
-// appends new data blocks for inode for increase file size
-extern int i_append_blocks(inode_t inode, block_t* new_blocks, int new_blocks_cnt);
+// maps new data blocks for inode from its file block fblks, pointers there are holes
+extern int i_append_blocks(inode_t inode, int fblks, block_t* new_blocks, int new_blocks_cnt);
 // update inode structures on disk
 extern int i_update(inode_t inode);
+// frees all data & map blocks of inode
+extern int i_free_blocks(inode_t inode);
+// sets file size, blocks past it are freed and new bytes read as zeros
+extern int i_truncate(inode_t inode, int size);
+// allocates blocks for holes of file bytes from offset, file size is not changed
+extern int i_fallocate(inode_t inode, int offset, int len);
+// inode locks - shared for reading, exclusive for changing file
+// locked inode is pinned, returns 0 for success and -1 for error
+extern int i_rdlock(inode_t inode);
+extern int i_wrlock(inode_t inode);
+extern void i_unlock(inode_t inode);
+
+// inode extents map - SFS_VERSION_EXTENT
+// empty map
+extern void e_init(ExtentMap *m);
+// returns absolute block number by file block, sets len of contiguous run
+// BLOCK_HOLE if no extent maps it, len is then number of blocks to next extent
+extern block_t e_getrun(inode_t inode, int blkid, int *len);
+// allocates contiguous runs for holes of file blocks first..last
+extern int e_fill(inode_t inode, int first, int last);
+// frees all data & extents blocks
+extern int e_free(inode_t inode);
+// frees data blocks of file blocks from fblks on and extents blocks left without extents
+extern int e_truncate(inode_t inode, int fblks);
+// copies level 0 index block with entry of chain block cid, or with block mapping blkid if cid < 0
+// sets base to chain block id of its first entry
+extern int e_index_leaf(inode_t inode, int cid, int blkid, ExtentIndex *leaf, int *base);
+
+// readahead of open files
+// reads like i_read, sequential reads of descriptor are served from its readahead buffer
+// called with inode lock held
+extern int ra_read(int fd, char *buf, int size, int pos);
+// drops readahead state, called when file is opened or written through descriptor
+extern void ra_reset(int fd);
+
+// write buffers of open files - sequential writes of descriptor are written together
+// blocks are allocated at flush, when size of buffered data is known
+// called with inode write lock held, inside bc_begin / bc_end
+// writes like i_write, data may stay in buffer until wb_flush
+extern int wb_write(int fd, const char *buf, int size, int pos);
+// writes buffered data, returns 0 for success and -1 for error
+extern int wb_flush(int fd);
+// file size with buffered data, called with inode lock held
+extern int wb_size(int fd);
+// frees buffer of closed descriptor, called with ofdt_lock held
+extern void wb_release(int fd);
+
+// metadata journal
+// sets journal region, no journal if nblocks is 0
+extern int j_init(int start, int nblocks);
+extern int j_enabled();
+// max blocks in one transaction
+extern int j_max_blocks();
+// journal size in blocks for transactions of up to cnt blocks
+extern int j_size(int cnt);
+// writes empty journal
+extern int j_format();
+// writes transaction to journal and flushes disk, transaction is committed after it
+extern int j_write(const blkvec_t *vec, int cnt);
+// marks last transaction as applied, called when its home blocks are on disk
+extern int j_checkpoint();
+// writes last committed transaction to its home blocks unless it was checkpointed, called at mount
+extern int j_replay();
+
+// block cache - write-back cache of metadata blocks, absolute block numbers
+// reads block through the cache
+extern int bc_read(block_t blk, void* buf);
+// writes whole block to the cache, disk is updated by eviction or bc_sync
+extern int bc_write(block_t blk, const void* buf);
+// writes len bytes at offset of block to the cache
+extern int bc_write_part(block_t blk, int offset, const void* buf, int len);
+// vectored data transfers, kept coherent with cached blocks
+extern int bc_read_v(const blkvec_t *vec, int nvec);
+extern int bc_write_v(const blkvec_t *vec, int nvec);
+// drops cached block without writing it back
+extern void bc_forget(block_t blk);
+// operations changing metadata are between bc_begin and bc_end
+// their changes are committed together when enough blocks are dirty
+extern void bc_begin();
+extern int bc_end();
+// commits dirty blocks now, may be called inside operation
+extern int bc_commit();
+// waits for running operations and writes all dirty blocks to disk
+extern int bc_sync();
+// empties the cache, dirty blocks are lost
+extern void bc_reset();
 
 
 
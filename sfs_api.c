@@ -2,22 +2,23 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
 
 #include "disk_emu.h"
 #include "sfs.h"
+#include "sfs_api.h"
 
 
 // ======================================================================================
 // disk structures in memory & caches
-// fs max size 8MB
+// sizes are set by superblock
 SuperBlock sblock;
-INode inodes[MAX_INODES]; 	// max size 81KB
-DirEntry *root = 0;			// max size 20KB
-bitmap_t freemap[MAX_FREEMAP_ID];
-block_t freemap_freeblocks;	// number of free blocks
+DirEntry *root = 0;			// 20KB for default fs size
+bitmap_t *freemap = 0;
+int freemap_freeblocks;		// number of free blocks
 
-block_t freemap_block; 		// free map is not greater than 1 block 1KB
 block_t first_data_block;
 
 // file search state
@@ -26,137 +27,277 @@ int last_search_index = -1; // not started
 // open files descriptor table
 FileDesc ofdt[MAX_FD];
 
-extern inode_t last_inode_block;
+// locks order: dir_lock, inode locks, ofdt_lock, block cache, allocator
+// cache commit snapshots the free map under allocator lock, b_alloc commits with no lock held
+// dir_lock guards root directory, its index and inodes allocation
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+// ofdt_lock guards ofdt entries allocation
+// it is a leaf below inode locks, only readahead locks and the allocator are taken while it is held
+static pthread_mutex_t ofdt_lock = PTHREAD_MUTEX_INITIALIZER;
 
+// ======================================================================================
+// flushes dirty cached blocks when the program ends
+static void sfs_sync_atexit()
+{
+	sfs_sync();
+}
 
+// ======================================================================================
+// closes previous mount: dirty blocks go to its image, cache starts empty
+static void sfs_unmount(int sync)
+{
+	static int sync_at_exit = 0;
+
+	if (sync) sfs_sync();
+	bc_reset();
+	if (!sync_at_exit) {
+		atexit(sfs_sync_atexit);
+		sync_at_exit = 1;
+	}
+}
 
 // ======================================================================================
-// mounts sfs
-void mksfs(int fresh)
+// checks superblock & sets layout defaults of older images
+// returns image size in blocks or -1 for error
+static int sfs_checksb()
 {
-	int ret, i;
-	if (fresh) ret = init_fresh_disk(FILESYSTEM_IMAGE_FILE, BLOCK_SIZE, MAX_FS_SIZE);
-	else ret = init_disk(FILESYSTEM_IMAGE_FILE, BLOCK_SIZE, MAX_FS_SIZE);
+	if (sblock.magic != SB_MAGIC) return -1; // error
+	if (sblock.blksize != BLOCK_SIZE) return -1; // error
+	if ((sblock.version < SFS_VERSION_BLKPTR) || (sblock.version > SFS_VERSION_TREE)) return -1; // error
+	if ((sblock.fssize <= 0) || (sblock.inodeBlks <= 0)) return -1; // error
+	if ((sblock.inodeRoot < 0) || (sblock.inodeRoot >= sblock.inodeBlks * INODES_PER_BLOCK)) return -1; // error
+
+	// older images: one freemap block after inodes, 16 bit inode & block numbers
+	if (sblock.version < SFS_VERSION_LARGE) {
+		if (sblock.fssize > MAX_BLOCK) return -1; // error
+		if (sblock.inodeBlks > MAX_INODE_BLOCKS) return -1; // error
+		if (!sblock.freemapBlks) {
+			sblock.freemapStart = 1 + sblock.inodeBlks;
+			sblock.freemapBlks = 1;
+		}
+		if (sblock.freemapBlks != 1) return -1; // error
+	}
+	if (sblock.freemapStart != 1 + sblock.inodeBlks) return -1; // error
+	if ((sblock.freemapBlks <= 0) || ((long long)sblock.freemapBlks * FREEMAP_BLOCK_BITS < sblock.fssize)) return -1; // error
+	if ((sblock.journalBlks < 0) || (sblock.journalBlks == 1)) return -1; // error
+	if (sblock.journalBlks && (sblock.journalStart != sblock.freemapStart + sblock.freemapBlks)) return -1; // error
+	if (sblock.inodemapBlks < 0) return -1; // error
+	if (sblock.inodemapBlks) {
+		if (sblock.version < SFS_VERSION_LARGE) return -1; // error
+		if (sblock.inodemapStart != sblock.freemapStart + sblock.freemapBlks + sblock.journalBlks) return -1; // error
+		if ((long long)sblock.inodemapBlks * FREEMAP_BLOCK_BITS < (long long)sblock.inodeBlks * INODES_PER_BLOCK) return -1; // error
+	}
+
+	long long total = (long long)sblock.freemapStart + sblock.freemapBlks + sblock.journalBlks + sblock.inodemapBlks + sblock.fssize;
+	if (total > 0x7fffffff) return -1; // error
+	if ((sblock.version < SFS_VERSION_LARGE) && (total > MAX_FS_SIZE)) return -1; // error
+	return (int)total;
+}
+
+// ======================================================================================
+// creates new image
+static int sfs_format(const sfs_opts_t *opts)
+{
+	int ret;
+
+	// geometry - 1% of disk for inodes by default
+	int blocks = (opts && (opts->blocks > 0)) ? opts->blocks : MAX_FS_SIZE;
+	int inode_blks = blocks / 100;
+	if (opts && (opts->inodes > 0)) inode_blks = (opts->inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	if (inode_blks <= 0) inode_blks = 1;
+	if (blocks <= 1 + inode_blks) return -1; // error - too small
+	int fm_blks = (blocks - 1 - inode_blks + FREEMAP_BLOCK_BITS - 1) / FREEMAP_BLOCK_BITS;
+	// journal takes whole cache, changed freemap blocks & superblock
+	int journal_blks = (SFS_VERSION == SFS_VERSION_BLKPTR) ? 0 : j_size(BC_MAX_BLOCKS + fm_blks + 1);
+	// older formats scan inode table for free inodes
+	long long inode_cnt = (long long)inode_blks * INODES_PER_BLOCK;
+	int im_blks = (SFS_VERSION < SFS_VERSION_LARGE) ? 0 : (int)((inode_cnt + FREEMAP_BLOCK_BITS - 1) / FREEMAP_BLOCK_BITS);
+	int fssize = blocks - 1 - inode_blks - fm_blks - journal_blks - im_blks;
+	if (fssize <= 0) return -1; // error - too small
+	if ((SFS_VERSION < SFS_VERSION_LARGE) && ((fssize > MAX_BLOCK) || (inode_blks > MAX_INODE_BLOCKS))) return -1; // error - needs SFS_VERSION_LARGE
+
+	ret = init_fresh_disk(FILESYSTEM_IMAGE_FILE, BLOCK_SIZE, blocks);
+	if (ret < 0) return -1; // error
+
+	// fill fs with defaults
+	block_t block = 0;
 	
-	if (ret < 0) return; // error
+	// init superblock
+	memset(&sblock, 0, sizeof(sblock));
+	sblock.magic = SB_MAGIC;
+	sblock.blksize = BLOCK_SIZE;
+	sblock.fssize = fssize;
+	sblock.inodeBlks = inode_blks;
+	sblock.inodeRoot = 0;
+	sblock.version = SFS_VERSION;
+	sblock.freemapStart = 1 + inode_blks;
+	sblock.freemapBlks = fm_blks;
+	sblock.journalStart = sblock.freemapStart + fm_blks;
+	sblock.journalBlks = journal_blks;
+	sblock.inodemapStart = sblock.journalStart + journal_blks;
+	sblock.inodemapBlks = im_blks;
+	sblock.groupBlocks = FM_GROUP_BLOCKS;
+	while ((fssize + sblock.groupBlocks - 1) / sblock.groupBlocks > SB_MAX_GROUPS) sblock.groupBlocks <<= 1;
+	ret = write_blocks(block, 1, &sblock); block++;
+	if ((ret < 0) || (ret != 1)) return -1; // error
 	
-	if (fresh) {
-		// fill fs with defaults
-		block_t block = 0;
-		
-		// init superblock
-		memset(&sblock, 0, sizeof(sblock));
-		sblock.magic = SB_MAGIC;
-		sblock.blksize = BLOCK_SIZE;
-		sblock.fssize = MAX_BLOCK;
-		sblock.inodeBlks = MAX_INODE_BLOCKS;
-		sblock.inodeRoot = 0;
-		ret = write_blocks(block, 1, &sblock); block++;
-		if ((ret < 0) || (ret != 1)) return; // error
-		
-		// init inodes
-		memset(inodes, 0, sizeof(inodes));
-		int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
-		for (i = 0; i < inode_cnt; i++)
-		{
-			memset(&inodes[i].blocks[0], BLOCK_FREE, sizeof(inodes[i].blocks));
-			inodes[i].next = BLOCK_FREE;
-		}
-		inodes[sblock.inodeRoot].used = 1; // open root dir
-		ret = write_blocks(block, sblock.inodeBlks, inodes); block += sblock.inodeBlks;
-		if ((ret < 0) || (ret != sblock.inodeBlks)) return; // error
+	// init inodes, root dir stays pinned while mounted
+	if (i_init() < 0) return -1; // error
+	if (i_format() < 0) return -1; // error
+	block += sblock.inodeBlks;
+	if (i_get(sblock.inodeRoot) < 0) return -1; // error
+
+	// init freemap
+	free(freemap);
+	freemap = calloc(sblock.freemapBlks, BLOCK_SIZE);
+	if (!freemap) return -1; // memory full
+	ret = write_blocks(block, sblock.freemapBlks, freemap); block += sblock.freemapBlks;
+	if ((ret < 0) || (ret != sblock.freemapBlks)) return -1; // error
+	if (fm_init() < 0) return -1; // error
+
+	// init journal
+	if (j_init(sblock.journalStart, sblock.journalBlks) < 0) return -1; // error
+	if (j_format() < 0) return -1; // error
+	block += sblock.journalBlks;
+
+	// init inode bitmap
+	if (im_format() < 0) return -1; // error
+	block += sblock.inodemapBlks;
+	
+	// set first data block
+	first_data_block = block;
 
-		// set where is freemap
-		freemap_block = block;
-		
-		// init freemap
-		memset(freemap, 0, sizeof(freemap));
-		ret = write_blocks(block, 1, freemap); block++;
-		if ((ret < 0) || (ret != 1)) return; // error
-		freemap_freeblocks = sblock.fssize;
-		
-		// set first data block
-		first_data_block = block;
+	// root dir is empty
+	if (root) free(root);
+	root = 0;
+	return 0;
+}
 
-		// root dir is empty
-		root = 0;
-	}
-	else {
-		// load fs data structures
-		block_t block = 0;
-		
-		// read superblock
-		ret = read_blocks(block, 1, &sblock); block++;
-		if ((ret < 0) || (ret != 1)) return; // error
-		
-		// check superblock
-		if (sblock.magic != SB_MAGIC) return; // error
-		if (sblock.blksize != BLOCK_SIZE) return; // error
-		if ((sblock.fssize <= 0) || (sblock.fssize > MAX_BLOCK)) return; // error
-		if ((sblock.inodeBlks <= 0) || (sblock.inodeBlks > MAX_INODE_BLOCKS)) return; // error
-		if ((sblock.inodeRoot < 0) || (sblock.inodeRoot >= MAX_INODES)) return; // error
-		
-		// read inodes
-		memset(inodes, 0, sizeof(inodes));
-		ret = read_blocks(block, sblock.inodeBlks, inodes); block += sblock.inodeBlks;
-		if ((ret < 0) || (ret != sblock.inodeBlks)) return; // error
+// ======================================================================================
+// loads existing image
+static int sfs_load()
+{
+	int ret, i;
 
-		// set where is freemap
-		freemap_block = block;
-		
-		// read freemap
-		memset(freemap, 0, sizeof(freemap));
-		ret = read_blocks(block, 1, freemap); block++;
-		if ((ret < 0) || (ret != 1)) return; // error
-		
-		// set first data block
-		first_data_block = block;
-		
-		// update freemap_freeblocks
-		freemap_freeblocks = sblock.fssize;
-		int blocks_rest = sblock.fssize;
-		for(i=0;i < sblock.fssize;i++)
-		{
-			bitmap_t bm = freemap[i];
-			for(int j=0;j < 32;j++) 
-			{
-				if ((bm & 1) != 0) freemap_freeblocks--;
-				bm >>= 1;
-				blocks_rest--;
-				if (blocks_rest <= 0) break;
-			}
-			if (blocks_rest <= 0) break;
-		}
-		
+	// image size is known from its superblock
+	ret = init_disk(FILESYSTEM_IMAGE_FILE, BLOCK_SIZE, MAX_FS_SIZE);
+	if (ret < 0) return -1; // error
+	
+	// read superblock
+	ret = read_blocks(0, 1, &sblock);
+	if ((ret < 0) || (ret != 1)) return -1; // error
+	int blocks = sfs_checksb();
+	if (blocks < 0) return -1; // error
+	if (blocks != MAX_FS_SIZE) {
+		ret = init_disk(FILESYSTEM_IMAGE_FILE, BLOCK_SIZE, blocks);
+		if (ret < 0) return -1; // error
+	}
 
-		// read root directory
-		if (root) free(root);
-		root = malloc(inodes[sblock.inodeRoot].size);
-		ret = i_read(sblock.inodeRoot, 0, (char *)root, inodes[sblock.inodeRoot].size);
-		if ((ret < 0) || (ret != inodes[sblock.inodeRoot].size)) return; // error
+	// finish last committed transaction before metadata is read
+	if (j_init(sblock.journalStart, sblock.journalBlks) < 0) return -1; // error
+	if (j_replay() < 0) return -1; // error
+	if (sblock.journalBlks) {
+		// transaction may carry superblock with free counts
+		ret = read_blocks(0, 1, &sblock);
+		if ((ret < 0) || (ret != 1)) return -1; // error
+		if (sfs_checksb() != blocks) return -1; // error
+	}
+	
+	// inodes are read on first use, root dir stays pinned while mounted
+	if (i_init() < 0) return -1; // error
+	if (i_get(sblock.inodeRoot) < 0) return -1; // error
+
+	// read freemap
+	free(freemap);
+	freemap = malloc((size_t)sblock.freemapBlks * BLOCK_SIZE);
+	if (!freemap) return -1; // memory full
+	ret = read_blocks(sblock.freemapStart, sblock.freemapBlks, freemap);
+	if ((ret < 0) || (ret != sblock.freemapBlks)) return -1; // error
+	
+	// set first data block
+	first_data_block = sblock.freemapStart + sblock.freemapBlks + sblock.journalBlks + sblock.inodemapBlks;
+	
+	// update freemap_freeblocks
+	if (fm_init() < 0) return -1; // error
+
+	// free inodes
+	if (im_init() < 0) return -1; // error
+
+	// read root directory
+	if (root) free(root);
+	int root_size = dir_size();
+	if (root_size < 0) return -1; // error
+	root = malloc(root_size);
+	ret = i_read(sblock.inodeRoot, 0, (char *)root, root_size);
+	if ((ret < 0) || (ret != root_size)) return -1; // error
+
+	// older images keep 16 bit inode numbers, next 2 bytes are padding (little endian)
+	if (sblock.version < SFS_VERSION_LARGE) {
+		int dir_entry_cnt = root_size / DIR_ENTRY_SIZE;
+		for(i=0;i < dir_entry_cnt;i++) root[i].inode = (short)root[i].inode;
 	}
+	return 0;
+}
+
+// ======================================================================================
+// resets open files & directory state of new mount
+static int sfs_mounted()
+{
+	int i;
+
+	// index root directory by filename
+	if (dir_index_build() < 0) return -1; // error
 	
 	// init open files descriptor table
-	for(i=0;i < MAX_FD;i++) ofdt[i].inode = INODE_FREE;
+	for(i=0;i < MAX_FD;i++) 
+	{
+		ofdt[i].inode = INODE_FREE;
+		ofdt[i].wb_len = 0;
+		ofdt[i].wb_resv = 0;
+	}
 	
 	last_search_index = -1;
 	
 	// all ok
+	return 0;
 }
 
 // ======================================================================================
-// Once all the files have been returned, this function returns 0.
-int sfs_getnextfilename(char* fname)
+// mounts sfs
+void mksfs(int fresh)
+{
+	if (fresh) {
+		mksfs_opts(0);
+		return;
+	}
+
+	sfs_unmount(1);
+	if (sfs_load() < 0) return; // error
+	sfs_mounted();
+}
+
+// ======================================================================================
+// creates sfs with given geometry
+int mksfs_opts(const sfs_opts_t *opts)
+{
+	sfs_unmount(0);
+	if (sfs_format(opts) < 0) return -1; // error
+	return sfs_mounted();
+}
+
+// ======================================================================================
+// returns next used root entry, called with dir_lock held
+static int dir_getnextfilename(char* fname)
 {
 	if (!root) return 0;
-	if (!fname) return 0;
 	
 	if (last_search_index < 0) {
 		// init search
 		last_search_index = 0;
 	}
 	
-	int dir_entry_cnt = inodes[sblock.inodeRoot].size / DIR_ENTRY_SIZE;
+	if (dir_size() < 0) return 0; // error
+	int dir_entry_cnt = dir_size() / DIR_ENTRY_SIZE;
 	
 	// skip empty records
 	while((last_search_index < dir_entry_cnt) && (root[last_search_index].inode == INODE_FREE)) {
@@ -176,52 +317,54 @@ int sfs_getnextfilename(char* fname)
 }
 
 // ======================================================================================
-// returns  the size of a given file if success or -1 otherwise
-int sfs_getfilesize(const char* fname)
+// Once all the files have been returned, this function returns 0.
+int sfs_getnextfilename(char* fname)
 {
-	if (!root) return -1;
-	if (!fname) return -1;
+	if (!fname) return 0;
 
-	int fid = dir_getfileid(fname);
-	if (fid < 0) return -1; // error
-	
-	return inodes[root[fid].inode].size;
+	pthread_mutex_lock(&dir_lock);
+	int ret = dir_getnextfilename(fname);
+	pthread_mutex_unlock(&dir_lock);
+	return ret;
 }
 
 // ======================================================================================
-// setup filepointer to the end of file
-// returns the index the file descriptor table (ofdt)
-int sfs_fopen(char* fname)
+// returns  the size of a given file if success or -1 otherwise
+int sfs_getfilesize(const char* fname)
 {
 	if (!fname) return -1;
-	if (strlen(fname) > MAX_FNAME_LENGTH) return -1; // fname too long
 
-	// try to find the file
-	dir_t fid = dir_getfileid(fname);
-	if (fid < 0) 
-	{
-		// file not found - try create file
-		fid = dir_getfreeid();
-		if (fid < 0) return -1;
-
-		inode_t n = i_alloc();
-		if (fid < 0) return -1;
-		
-		// allocates dir entry
-		root[fid].inode = n;
-		strncpy(root[fid].filename, fname, sizeof(root[fid].filename)-1);
+	pthread_mutex_lock(&dir_lock);
+	int size = -1;
+	int fid = dir_getfileid(fname);
+	inode_t inode = (fid >= 0) ? root[fid].inode : INODE_FREE;
+	if ((fid >= 0) && (i_rdlock(inode) == 0)) {
+		size = i_mem(inode)->size;
 
-		// updates disk structures^ inodes & root directory
-		if (i_update(n) < 0) return -1;
-		if (dir_update(fid) < 0) return -1;
+		// open file may have buffered writes
+		pthread_mutex_lock(&ofdt_lock);
+		for(int fd=0;fd < MAX_FD;fd++)
+		{
+			if (ofdt[fd].inode == inode) size = wb_size(fd);
+		}
+		pthread_mutex_unlock(&ofdt_lock);
+		i_unlock(inode);
 	}
+	pthread_mutex_unlock(&dir_lock);
+	
+	return size;
+}
 
+// ======================================================================================
+// allocates ofdt entry for pinned inode, called with ofdt_lock held
+static int ofdt_alloc(inode_t inode)
+{
 	// check ofdt for open file
 	int fd = 0;
 	while (fd < MAX_FD)
 	{
 		// reopen opened file not allowed
-		if (ofdt[fd].inode == root[fid].inode) return -1; // error
+		if (ofdt[fd].inode == inode) return -1; // error
 		fd++;
 	}
 
@@ -237,14 +380,84 @@ int sfs_fopen(char* fname)
 	if (fd >= MAX_FD) return -1; // ofdt is full
 
 	// allocate ofdt entry
-	ofdt[fd].inode = root[fid].inode;
+	ofdt[fd].inode = inode;
 	// setup filepointer to the end of file
-	ofdt[fd].iopos = inodes[ofdt[fd].inode].size;
+	ofdt[fd].iopos = i_mem(inode)->size;
+	ra_reset(fd);
 	
 	return fd;
 	
 }
 
+// ======================================================================================
+// finds or creates file and opens it, called with dir_lock held
+static int dir_fopen(char* fname)
+{
+	// try to find the file
+	dir_t fid = dir_getfileid(fname);
+	if (fid < 0) 
+	{
+		// file not found - try create file
+		fid = dir_getfreeid();
+		if (fid < 0) return -1;
+
+		// inode record is saved by i_alloc
+		inode_t n = i_alloc();
+		if (n < 0) return -1; // inodes table is full
+		
+		// allocates dir entry
+		root[fid].inode = n;
+		strncpy(root[fid].filename, fname, sizeof(root[fid].filename)-1);
+		dir_index_add(fid);
+
+		// updates disk structures^ root directory
+		if (dir_update(fid) < 0) return -1;
+	}
+
+	inode_t inode = root[fid].inode;
+	if (i_get(inode) < 0) return -1; // error
+	pthread_mutex_lock(&ofdt_lock);
+	int fd = ofdt_alloc(inode);
+	pthread_mutex_unlock(&ofdt_lock);
+	i_put(inode);
+	return fd;
+}
+
+// ======================================================================================
+// setup filepointer to the end of file
+// returns the index the file descriptor table (ofdt)
+int sfs_fopen(char* fname)
+{
+	if (!fname) return -1;
+	if (strlen(fname) > MAX_FNAME_LENGTH) return -1; // fname too long
+
+	bc_begin();
+	pthread_mutex_lock(&dir_lock);
+	int fd = dir_fopen(fname);
+	pthread_mutex_unlock(&dir_lock);
+	bc_end();
+	return fd;
+}
+
+// ======================================================================================
+// writes buffered writes of descriptor opened for inode, called without locks
+// returns 0 if success or a negative value otherwise
+static int fd_flush(int fd, inode_t inode)
+{
+	bc_begin();
+	if (i_wrlock(inode) < 0) {
+		bc_end();
+		return -1; // error
+	}
+	pthread_mutex_lock(&ofdt_lock);
+	int same = (ofdt[fd].inode == inode);
+	pthread_mutex_unlock(&ofdt_lock);
+	int ret = same ? wb_flush(fd) : 0;
+	i_unlock(inode);
+	bc_end();
+	return ret;
+}
+
 // ======================================================================================
 // removes the entry from the fdt
 // returns 0 if success or a negative value otherwise
@@ -254,11 +467,24 @@ int sfs_fclose(int fd)
 	if (fd < 0) return -1;
 	if (fd >= MAX_FD) return -1;
 	
+	pthread_mutex_lock(&ofdt_lock);
+	inode_t inode = ofdt[fd].inode;
+	pthread_mutex_unlock(&ofdt_lock);
+	if (inode == INODE_FREE) return -1; // already closed file
+
+	// buffered writes go to file, entry is removed even if they fail
+	int ret = fd_flush(fd, inode);
+
 	// remove ofdt entry
-	if (ofdt[fd].inode == INODE_FREE) return -1; // already closed file
-	ofdt[fd].inode = INODE_FREE;
+	pthread_mutex_lock(&ofdt_lock);
+	if (ofdt[fd].inode != INODE_FREE) {
+		ofdt[fd].inode = INODE_FREE;
+		wb_release(fd);
+	}
+	else ret = -1; // already closed file
+	pthread_mutex_unlock(&ofdt_lock);
 	
-	return 0;
+	return ret;
 }
 
 // ======================================================================================
@@ -272,11 +498,21 @@ int sfs_fwrite(int fd, const char* buf, int size)
 	if (fd >= MAX_FD) return 0;
 	if (ofdt[fd].inode <= INODE_FREE) return 0; // not opened file
 	if (ofdt[fd].inode >= inode_cnt) return 0;
-
-	int ret = i_write(ofdt[fd].inode, ofdt[fd].iopos, buf, size);
+	if (size <= 0) return 0;
+	if (ofdt[fd].iopos > INT_MAX - size) return 0; // file would grow past max size
+
+	inode_t inode = ofdt[fd].inode;
+	bc_begin();
+	if (i_wrlock(inode) < 0) {
+		bc_end();
+		return 0; // error
+	}
+	int ret = wb_write(fd, buf, size, ofdt[fd].iopos);
 
 	// update file position
 	if (ret > 0) ofdt[fd].iopos += ret;
+	i_unlock(inode);
+	bc_end();
 
 	return ret;
 }
@@ -293,10 +529,19 @@ int sfs_fread(int fd, char* buf, int size)
 	if (ofdt[fd].inode <= INODE_FREE) return 0; // not opened file
 	if (ofdt[fd].inode >= inode_cnt) return 0;
 
-	int ret = i_read(ofdt[fd].inode, ofdt[fd].iopos, buf, size);
+	inode_t inode = ofdt[fd].inode;
+	if (i_rdlock(inode) < 0) return 0; // error
+	// buffered writes go to file before it is read
+	if (ofdt[fd].wb_len > 0) {
+		i_unlock(inode);
+		if (fd_flush(fd, inode) < 0) return 0; // error
+		if (i_rdlock(inode) < 0) return 0; // error
+	}
+	int ret = ra_read(fd, buf, size, ofdt[fd].iopos);
 
 	// update file position
 	if (ret > 0) ofdt[fd].iopos += ret;
+	i_unlock(inode);
 
 	return ret;
 }
@@ -311,22 +556,160 @@ int sfs_fseek(int fd, int pos)
 	if (ofdt[fd].inode == INODE_FREE) return -1; // not opened file
 
 	if (pos < 0) return -1;
-	if (pos > inodes[ofdt[fd].inode].size) return -1; // wrong file position
-	
+
+	// position past end of file is allowed, skipped bytes are a hole
+	inode_t inode = ofdt[fd].inode;
+	if (fd_flush(fd, inode) < 0) return -1; // error
+	if (i_rdlock(inode) < 0) return -1; // error
 	// update ofdt entry
 	ofdt[fd].iopos = pos;
+	i_unlock(inode);
 	
 	return 0;
 }
 
 // ======================================================================================
-// removes the file from the directory entry, releases the i-Node and 
-// releases the data blocks used by the file
-// (i.e., the data blocks are added to the free block list/map)
-int sfs_remove(char* fname)
+// returns the number of bytes written at offset pos if success or 0 otherwise
+// file position is not changed
+int sfs_pwrite(int fd, const char* buf, int size, int pos)
+{
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+
+	// check params
+	if (fd < 0) return 0;
+	if (fd >= MAX_FD) return 0;
+	if (ofdt[fd].inode <= INODE_FREE) return 0; // not opened file
+	if (ofdt[fd].inode >= inode_cnt) return 0;
+
+	if (pos < 0) return 0;
+	if (size <= 0) return 0;
+	if (pos > INT_MAX - size) return 0; // file would grow past max size
+
+	inode_t inode = ofdt[fd].inode;
+	bc_begin();
+	if (i_wrlock(inode) < 0) {
+		bc_end();
+		return 0; // error
+	}
+	int ret = wb_write(fd, buf, size, pos);
+	i_unlock(inode);
+	bc_end();
+
+	return ret;
+}
+
+// ======================================================================================
+// returns the number of bytes readed at offset pos if success or 0 otherwise
+// file position is not changed
+int sfs_pread(int fd, char* buf, int size, int pos)
+{
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+
+	// check params
+	if (fd < 0) return 0;
+	if (fd >= MAX_FD) return 0;
+	if (ofdt[fd].inode <= INODE_FREE) return 0; // not opened file
+	if (ofdt[fd].inode >= inode_cnt) return 0;
+
+	inode_t inode = ofdt[fd].inode;
+	if (i_rdlock(inode) < 0) return 0; // error
+	// buffered writes go to file before it is read
+	if (ofdt[fd].wb_len > 0) {
+		i_unlock(inode);
+		if (fd_flush(fd, inode) < 0) return 0; // error
+		if (i_rdlock(inode) < 0) return 0; // error
+	}
+	int ret = ra_read(fd, buf, size, pos);
+	i_unlock(inode);
+
+	return ret;
+}
+
+// ======================================================================================
+// sets file size to len, blocks past it are freed and bytes added read as zeros
+// file position is not changed
+// returns 0 if success or a negative value otherwise
+int sfs_ftruncate(int fd, int len)
+{
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+
+	// check params
+	if (fd < 0) return -1;
+	if (fd >= MAX_FD) return -1;
+	if (ofdt[fd].inode <= INODE_FREE) return -1; // not opened file
+	if (ofdt[fd].inode >= inode_cnt) return -1;
+
+	if (len < 0) return -1;
+
+	inode_t inode = ofdt[fd].inode;
+	bc_begin();
+	if (i_wrlock(inode) < 0) {
+		bc_end();
+		return -1; // error
+	}
+	// buffered writes go to file before it is cut
+	ra_reset(fd);
+	int ret = wb_flush(fd);
+	if (ret == 0) ret = i_truncate(inode, len);
+	i_unlock(inode);
+	bc_end();
+
+	return ret;
+}
+
+// ======================================================================================
+// allocates blocks for len bytes of file from offset, file size is not changed
+// returns 0 if success or a negative value otherwise
+int sfs_fallocate(int fd, int offset, int len)
+{
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+
+	// check params
+	if (fd < 0) return -1;
+	if (fd >= MAX_FD) return -1;
+	if (ofdt[fd].inode <= INODE_FREE) return -1; // not opened file
+	if (ofdt[fd].inode >= inode_cnt) return -1;
+
+	if ((offset < 0) || (len <= 0)) return -1;
+
+	inode_t inode = ofdt[fd].inode;
+	bc_begin();
+	if (i_wrlock(inode) < 0) {
+		bc_end();
+		return -1; // error
+	}
+	int ret = i_fallocate(inode, offset, len);
+	i_unlock(inode);
+	bc_end();
+
+	return ret;
+}
+
+// ======================================================================================
+// writes cached changes to disk and flushes the disk
+// returns 0 if success or a negative value otherwise
+int sfs_sync()
+{
+	// buffered writes of open files
+	int ret = 0;
+	for(int fd=0;fd < MAX_FD;fd++)
+	{
+		pthread_mutex_lock(&ofdt_lock);
+		inode_t inode = ofdt[fd].inode;
+		pthread_mutex_unlock(&ofdt_lock);
+		if ((inode != INODE_FREE) && (fd_flush(fd, inode) < 0)) ret = -1; // error
+	}
+
+	if (bc_sync() < 0) return -1; // error
+	if (sync_disk() < 0) return -1; // error
+	return ret;
+}
+
+// ======================================================================================
+// removes file, called with dir_lock held
+static int dir_remove(char* fname)
 {
 	if (!root) return -1;
-	if (!fname) return -1;
 
 	int fid = dir_getfileid(fname);
 	if (fid < 0) return -1; // error
@@ -338,45 +721,37 @@ int sfs_remove(char* fname)
 	if (inode == sblock.inodeRoot) return -1; // error
 	
 	// check ofdt for open file
+	pthread_mutex_lock(&ofdt_lock);
 	int fd = 0;
 	while(fd < MAX_FD) 
 	{
 		// removing opened file not allowed
-		if (ofdt[fd].inode == inode) return -1; // error
+		if (ofdt[fd].inode == inode) break;
 		fd++;
 	}
+	pthread_mutex_unlock(&ofdt_lock);
+	if (fd < MAX_FD) return -1; // error
 
 	// remove file from root directory
+	dir_index_remove(fid);
 	root[fid].inode = INODE_FREE;
 	
 	// free file inode blocks
 	// free file data blocks
-	int fblks = (inodes[inode].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	block_t prev_inode_block = -1;
-	for(int i=0;i < fblks;i++) 
-	{
-		block_t blk = i_getblk(inode, i);
-		if (blk < 0) return -1; // error
-		blk -= first_data_block; // gets logical block
-		
-		// free file data blocks
-		if (b_free(blk) < 0) return -1; // error
-
-		// free file inode blocks
-		if (prev_inode_block != last_inode_block) 
-		{
-			prev_inode_block = last_inode_block;
-			if (b_free(last_inode_block) < 0) return -1; // error
-		}
-	}
+	if (i_wrlock(inode) < 0) return -1; // error
+	int ret = i_free_blocks(inode);
 
 	// remove file inode
-	inodes[inode].used = 0;
+	if (ret == 0) {
+		i_mem(inode)->used = 0;
+		ret = i_update(inode);
+		if (ret == 0) im_free(inode);
+	}
+	i_unlock(inode);
+	if (ret < 0) return -1; // error
 
 	// save changes
 	if (dir_update(fid) < 0) return -1;
-	if (i_update(inode) < 0) return -1;
-	if (fm_update() < 0) return -1; // error
 	
 	return 0;
 
@@ -385,5 +760,21 @@ int sfs_remove(char* fname)
 }
 
 // ======================================================================================
+// removes the file from the directory entry, releases the i-Node and 
+// releases the data blocks used by the file
+// (i.e., the data blocks are added to the free block list/map)
+int sfs_remove(char* fname)
+{
+	if (!fname) return -1;
+
+	bc_begin();
+	pthread_mutex_lock(&dir_lock);
+	int ret = dir_remove(fname);
+	pthread_mutex_unlock(&dir_lock);
+	bc_end();
+	return ret;
+}
+
+// ======================================================================================
 
 
@@ -8,6 +8,16 @@
 // if param != 0 mksfs creates new sfs image
 void mksfs(int fresh);
 
+// geometry of new sfs image, 0 selects default
+typedef struct {
+	int blocks;		// image size in 1KB blocks, 8MB by default
+	int inodes;		// max number of files, 1% of image by default
+} sfs_opts_t;
+
+// creates new sfs image with given geometry, default one if opts is 0
+// returns 0 for success and -1 for error
+int mksfs_opts(const sfs_opts_t *opts);
+
 // returns next filename in sfs root directory
 // returns 0 for success and -1 for error
 int sfs_getnextfilename(char* fname);
@@ -19,7 +29,8 @@ int sfs_getfilesize(const char* fname);
 // returns file descriptor for success and -1 for error
 int sfs_fopen(char* fname);
 
-// closes file
+// closes file, buffered data goes to the image but it is not synced
+// changes survive a crash only after sfs_sync, exit or a later commit of the block cache
 // returns 0 for success and -1 for error
 int sfs_fclose(int fd);
 
@@ -31,12 +42,34 @@ int sfs_fwrite(int fd, const char* buf, int size);
 // returns number of bytes readed for success and 0 for error
 int sfs_fread(int fd, char* buf, int size);
 
-// set file position for file
+// set file position for file, it may be past end of file
+// bytes skipped by a write past end of file read as zeros
 // returns 0 for success and -1 for error
 int sfs_fseek(int fd, int pos);
 
+// writes user data to file at position pos, file position is not changed
+// returns number of bytes writed for success and 0 for error
+int sfs_pwrite(int fd, const char* buf, int size, int pos);
+
+// reads user data from file at position pos, file position is not changed
+// returns number of bytes readed for success and 0 for error
+int sfs_pread(int fd, char* buf, int size, int pos);
+
+// sets size of file to len, blocks past it are freed, bytes added read as zeros
+// file position is not changed
+// returns 0 for success and -1 for error
+int sfs_ftruncate(int fd, int len);
+
+// allocates blocks for len bytes of file from offset ahead of writes, file size is not changed
+// returns 0 for success and -1 for error
+int sfs_fallocate(int fd, int offset, int len);
+
 // removes file
 // returns 0 for success and -1 for error
 int sfs_remove(char* fname);
 
+// writes all cached changes to disk and syncs it, this is the durability point of sfs
+// returns 0 for success and -1 for error
+int sfs_sync();
+
 #endif
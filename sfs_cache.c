@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "disk_emu.h"
+#include "sfs.h"
+
+
+// hash table size, power of 2
+#define BC_HASH			256
+#define BC_NONE			-1
+// dirty blocks which make the end of operation commit them
+#define BC_COMMIT_BLOCKS	(BC_BLOCKS / 2)
+
+// cached disk block
+typedef struct {
+	block_t blk;		// absolute disk block, BLOCK_FREE if slot is empty
+	int dirty;			// not 0 if block must be written back
+	int prev, next;		// LRU list, head is most recently used
+	int hnext;			// hash chain
+	byte_t data[BLOCK_SIZE];
+} CacheBlock;
+
+static CacheBlock cache[BC_MAX_BLOCKS];
+static int bc_nblocks = BC_BLOCKS;	// slots in use
+static int bc_hash[BC_HASH];
+static int lru_head = BC_NONE;
+static int lru_tail = BC_NONE;
+static int bc_ready = 0;
+static int bc_ndirty = 0;
+// guards cache slots, disk transfers of data blocks are done without it
+static pthread_mutex_t bc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// operations in progress, commit waits until they end - see bc_begin
+static int bc_ops = 0;
+static int bc_commit_wait = 0;
+static pthread_cond_t bc_cond = PTHREAD_COND_INITIALIZER;
+
+static int bc_flush();
+
+
+static int bc_hashid(block_t blk)
+{
+	return blk & (BC_HASH - 1);
+}
+
+static void lru_unlink(int id)
+{
+	if (cache[id].prev != BC_NONE) cache[cache[id].prev].next = cache[id].next;
+	else lru_head = cache[id].next;
+	if (cache[id].next != BC_NONE) cache[cache[id].next].prev = cache[id].prev;
+	else lru_tail = cache[id].prev;
+}
+
+static void lru_push_head(int id)
+{
+	cache[id].prev = BC_NONE;
+	cache[id].next = lru_head;
+	if (lru_head != BC_NONE) cache[lru_head].prev = id;
+	lru_head = id;
+	if (lru_tail == BC_NONE) lru_tail = id;
+}
+
+static void lru_push_tail(int id)
+{
+	cache[id].next = BC_NONE;
+	cache[id].prev = lru_tail;
+	if (lru_tail != BC_NONE) cache[lru_tail].next = id;
+	lru_tail = id;
+	if (lru_head == BC_NONE) lru_head = id;
+}
+
+static void set_dirty(int id, int dirty)
+{
+	if (cache[id].dirty != dirty) bc_ndirty += dirty ? 1 : -1;
+	cache[id].dirty = dirty;
+}
+
+static void hash_remove(int id)
+{
+	int *pp = &bc_hash[bc_hashid(cache[id].blk)];
+	while (*pp != BC_NONE)
+	{
+		if (*pp == id) {
+			*pp = cache[id].hnext;
+			break;
+		}
+		pp = &cache[*pp].hnext;
+	}
+	cache[id].blk = BLOCK_FREE;
+	set_dirty(id, 0);
+}
+
+// empties the cache, called with bc_lock held
+static void bc_init()
+{
+	int i;
+	for (i = 0; i < BC_HASH; i++) bc_hash[i] = BC_NONE;
+	lru_head = lru_tail = BC_NONE;
+	bc_nblocks = BC_BLOCKS;
+	for (i = 0; i < bc_nblocks; i++)
+	{
+		cache[i].blk = BLOCK_FREE;
+		cache[i].dirty = 0;
+		cache[i].hnext = BC_NONE;
+		lru_push_tail(i);
+	}
+	bc_ndirty = 0;
+	bc_ready = 1;
+}
+
+// returns cache slot of block or BC_NONE
+static int bc_lookup(block_t blk)
+{
+	if (!bc_ready) return BC_NONE;
+
+	int id = bc_hash[bc_hashid(blk)];
+	while ((id != BC_NONE) && (cache[id].blk != blk)) id = cache[id].hnext;
+	return id;
+}
+
+// dirty blocks which fit one transaction with free map blocks & superblock
+static int bc_max_dirty()
+{
+	int max = j_max_blocks() - sblock.freemapBlks - 1;
+	return (max < BC_MAX_BLOCKS) ? max : BC_MAX_BLOCKS;
+}
+
+// adds empty slot at the end of LRU list, BC_NONE if cache cannot grow
+static int bc_grow()
+{
+	if ((bc_nblocks >= BC_MAX_BLOCKS) || (bc_nblocks >= bc_max_dirty())) return BC_NONE;
+
+	int id = bc_nblocks++;
+	cache[id].blk = BLOCK_FREE;
+	cache[id].dirty = 0;
+	cache[id].hnext = BC_NONE;
+	lru_push_tail(id);
+	return id;
+}
+
+// takes least recently used slot for block, writes back its old content if dirty
+static int bc_getslot(block_t blk)
+{
+	if (!bc_ready) bc_init();
+
+	int id = lru_tail;
+	if (j_enabled()) 
+	{
+		// dirty blocks reach disk only by commit - take least recently used clean slot
+		while ((id != BC_NONE) && cache[id].dirty) id = cache[id].prev;
+		if (id == BC_NONE) {
+			// cache is full of dirty blocks of operations in progress
+			// commit now would log them half done - cache grows, operation fails if it cannot
+			id = bc_grow();
+			if (id == BC_NONE) return BC_NONE; // error - operation is too big for journal
+		}
+	}
+	if (cache[id].blk != BLOCK_FREE)
+	{
+		if (cache[id].dirty) {
+			int ret = write_blocks(cache[id].blk, 1, cache[id].data);
+			if ((ret < 0) || (ret != 1)) return BC_NONE; // error
+		}
+		hash_remove(id);
+	}
+
+	cache[id].blk = blk;
+	set_dirty(id, 0);
+	int h = bc_hashid(blk);
+	cache[id].hnext = bc_hash[h];
+	bc_hash[h] = id;
+	return id;
+}
+
+// returns cache slot with block, reads block from disk on miss
+static int bc_load(block_t blk)
+{
+	int id = bc_lookup(blk);
+	if (id != BC_NONE) return id;
+
+	id = bc_getslot(blk);
+	if (id == BC_NONE) return BC_NONE; // error
+
+	int ret = read_blocks(blk, 1, cache[id].data);
+	if ((ret < 0) || (ret != 1)) {
+		hash_remove(id);
+		return BC_NONE; // error
+	}
+	return id;
+}
+
+void bc_reset()
+{
+	pthread_mutex_lock(&bc_lock);
+	bc_init();
+	pthread_mutex_unlock(&bc_lock);
+}
+
+int bc_read(block_t blk, void* buf)
+{
+	pthread_mutex_lock(&bc_lock);
+	int id = bc_load(blk);
+	if (id == BC_NONE) {
+		pthread_mutex_unlock(&bc_lock);
+		return -1; // error
+	}
+
+	lru_unlink(id);
+	lru_push_head(id);
+	memcpy(buf, cache[id].data, BLOCK_SIZE);
+	pthread_mutex_unlock(&bc_lock);
+	return 0;
+}
+
+int bc_write(block_t blk, const void* buf)
+{
+	pthread_mutex_lock(&bc_lock);
+	int id = bc_lookup(blk);
+	if (id == BC_NONE)
+	{
+		// whole block is replaced - no need to read it
+		id = bc_getslot(blk);
+		if (id == BC_NONE) {
+			pthread_mutex_unlock(&bc_lock);
+			return -1; // error
+		}
+	}
+
+	lru_unlink(id);
+	lru_push_head(id);
+	memcpy(cache[id].data, buf, BLOCK_SIZE);
+	set_dirty(id, 1);
+	pthread_mutex_unlock(&bc_lock);
+	return 0;
+}
+
+int bc_write_part(block_t blk, int offset, const void* buf, int len)
+{
+	// rest of block is kept - it is loaded on miss
+	pthread_mutex_lock(&bc_lock);
+	int id = bc_load(blk);
+	if (id == BC_NONE) {
+		pthread_mutex_unlock(&bc_lock);
+		return -1; // error
+	}
+
+	lru_unlink(id);
+	lru_push_head(id);
+	memcpy(cache[id].data + offset, buf, len);
+	set_dirty(id, 1);
+	pthread_mutex_unlock(&bc_lock);
+	return 0;
+}
+
+void bc_forget(block_t blk)
+{
+	pthread_mutex_lock(&bc_lock);
+	int id = bc_lookup(blk);
+	if (id != BC_NONE) {
+		hash_remove(id);
+		lru_unlink(id);
+		lru_push_tail(id);
+	}
+	pthread_mutex_unlock(&bc_lock);
+}
+
+int bc_read_v(const blkvec_t *vec, int nvec)
+{
+	int ret = read_blocks_v(vec, nvec);
+	if (ret < 0) return ret; // error
+
+	// cached blocks are never older than disk blocks
+	pthread_mutex_lock(&bc_lock);
+	for (int i = 0; i < nvec; i++)
+	{
+		for (int j = 0; j < vec[i].nblocks; j++)
+		{
+			int id = bc_lookup(vec[i].start_address + j);
+			if (id != BC_NONE) {
+				memcpy((byte_t *)vec[i].buffer + j * BLOCK_SIZE, cache[id].data, BLOCK_SIZE);
+			}
+		}
+	}
+	pthread_mutex_unlock(&bc_lock);
+	return ret;
+}
+
+int bc_write_v(const blkvec_t *vec, int nvec)
+{
+	// cached copies get the new data, disk write makes them clean
+	pthread_mutex_lock(&bc_lock);
+	for (int i = 0; i < nvec; i++)
+	{
+		for (int j = 0; j < vec[i].nblocks; j++)
+		{
+			int id = bc_lookup(vec[i].start_address + j);
+			if (id != BC_NONE) {
+				memcpy(cache[id].data, (byte_t *)vec[i].buffer + j * BLOCK_SIZE, BLOCK_SIZE);
+				set_dirty(id, 0);
+			}
+		}
+	}
+	pthread_mutex_unlock(&bc_lock);
+	return write_blocks_v(vec, nvec);
+}
+
+static int bc_cmp(const void *a, const void *b)
+{
+	return ((const blkvec_t *)a)->start_address - ((const blkvec_t *)b)->start_address;
+}
+
+// commits dirty blocks, called with bc_lock held
+// with journal they go to journal first, then to their home blocks
+static int bc_flush()
+{
+	if (!bc_ready) return 0;
+
+	// freemap is taken at commit, operations change it in memory
+	// freemap blocks are not cached, only changed ones are written
+	const bitmap_t *fm;
+	int *fm_blks;
+	int fm_changed = fm_snapshot(&fm, &fm_blks);
+
+	// collect dirty blocks
+	blkvec_t vec[bc_nblocks + fm_changed + 1];
+	int cnt = 0;
+	for (int i = 0; i < bc_nblocks; i++)
+	{
+		if ((cache[i].blk == BLOCK_FREE) || !cache[i].dirty) continue;
+		vec[cnt].start_address = cache[i].blk;
+		vec[cnt].nblocks = 1;
+		vec[cnt].buffer = cache[i].data;
+		cnt++;
+	}
+	for (int i = 0; i < fm_changed; i++)
+	{
+		vec[cnt].start_address = sblock.freemapStart + fm_blks[i];
+		vec[cnt].nblocks = 1;
+		vec[cnt].buffer = (void *)&fm[fm_blks[i] * MAX_FREEMAP_ID];
+		cnt++;
+	}
+	// superblock keeps free counts of this free map
+	SuperBlock sb;
+	if (fm_changed && sblock.groups) {
+		sb = sblock;
+		vec[cnt].start_address = 0;
+		vec[cnt].nblocks = 1;
+		vec[cnt].buffer = &sb;
+		cnt++;
+	}
+	if (cnt == 0) return 0;
+	qsort(vec, cnt, sizeof(blkvec_t), bc_cmp);
+
+	// transaction is on disk before any home block is changed
+	if (j_enabled() && (j_write(vec, cnt) < 0)) return -1; // error
+
+	// write them back as one vectored request
+	int ret = write_blocks_v(vec, cnt);
+	if ((ret < 0) || (ret != cnt)) return -1; // error
+
+	// home blocks are on disk before journal is reused
+	if (j_enabled()) {
+		if (sync_disk() < 0) return -1; // error
+		if (j_checkpoint() < 0) return -1; // error
+		fm_commit_done();
+	}
+
+	for (int i = 0; i < bc_nblocks; i++) set_dirty(i, 0);
+	return 0;
+}
+
+void bc_begin()
+{
+	pthread_mutex_lock(&bc_lock);
+	while (bc_commit_wait) pthread_cond_wait(&bc_cond, &bc_lock);
+	bc_ops++;
+	pthread_mutex_unlock(&bc_lock);
+}
+
+int bc_end()
+{
+	int ret = 0;
+	pthread_mutex_lock(&bc_lock);
+	bc_ops--;
+
+	// group commit - last operation commits blocks of all operations
+	if (bc_ndirty >= BC_COMMIT_BLOCKS) bc_commit_wait = 1;
+	if (bc_commit_wait && (bc_ops == 0)) {
+		ret = bc_flush();
+		bc_commit_wait = 0;
+		pthread_cond_broadcast(&bc_cond);
+	}
+	pthread_mutex_unlock(&bc_lock);
+	return ret;
+}
+
+int bc_commit()
+{
+	pthread_mutex_lock(&bc_lock);
+	int ret = bc_flush();
+	pthread_mutex_unlock(&bc_lock);
+	return ret;
+}
+
+int bc_sync()
+{
+	pthread_mutex_lock(&bc_lock);
+	bc_commit_wait = 1;
+	while (bc_ops > 0) pthread_cond_wait(&bc_cond, &bc_lock);
+	int ret = bc_flush();
+	bc_commit_wait = 0;
+	pthread_cond_broadcast(&bc_cond);
+	pthread_mutex_unlock(&bc_lock);
+	return ret;
+}
@@ -4,18 +4,113 @@
 
 #include "sfs.h"
 
+
+// directory index: filename hash -> directory entry
+// open addressing, slot keeps fid + 1, 0 for empty slot
+#define DIR_HASH_MIN		1024
+#define DIR_HASH_EMPTY		0
+
+static int *dir_hash = 0;
+static int dir_hash_size = 0;	// power of 2, more than 2 * inodes
+
+// FNV-1a hash of filename
+static unsigned int dir_hashname(const char* fname)
+{
+	unsigned int h = 2166136261u;
+	while (*fname) {
+		h ^= (unsigned char)*fname++;
+		h *= 16777619u;
+	}
+	return h & (dir_hash_size - 1);
+}
+
+// returns index slot of fname or empty slot where it should be
+static int dir_hashslot(const char* fname)
+{
+	int slot = dir_hashname(fname);
+	while (dir_hash[slot] != DIR_HASH_EMPTY)
+	{
+		if (!strcmp(root[dir_hash[slot] - 1].filename, fname)) break;
+		slot = (slot + 1) & (dir_hash_size - 1);
+	}
+	return slot;
+}
+
+void dir_index_add(int fid)
+{
+	int slot = dir_hashslot(root[fid].filename);
+	dir_hash[slot] = fid + 1;
+}
+
+void dir_index_remove(int fid)
+{
+	int i = dir_hashslot(root[fid].filename);
+	if (dir_hash[i] != fid + 1) return; // not indexed
+
+	// shift following entries of probe sequence back to the freed slot
+	int j = i;
+	for(;;)
+	{
+		j = (j + 1) & (dir_hash_size - 1);
+		if (dir_hash[j] == DIR_HASH_EMPTY) break;
+
+		// entry can move to i if its home slot is not between i and j
+		int k = dir_hashname(root[dir_hash[j] - 1].filename);
+		if ((i < j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) 
+		{
+			dir_hash[i] = dir_hash[j];
+			i = j;
+		}
+	}
+	dir_hash[i] = DIR_HASH_EMPTY;
+}
+
+int dir_size()
+{
+	INodeMem *im = i_mem(sblock.inodeRoot);
+	if (!im) return -1; // error - unmounted image
+	return im->size;
+}
+
+int dir_index_build()
+{
+	// index is sized by inode table of this image
+	int size = DIR_HASH_MIN;
+	while (size < 2 * sblock.inodeBlks * INODES_PER_BLOCK) size <<= 1;
+	if (size != dir_hash_size) {
+		free(dir_hash);
+		dir_hash = malloc(size * sizeof(int));
+		dir_hash_size = dir_hash ? size : 0;
+		if (!dir_hash) return -1; // memory full
+	}
+	memset(dir_hash, 0, size * sizeof(int));
+	if (!root) return 0;
+
+	int dsize = dir_size();
+	if (dsize < 0) return -1; // error
+	int dir_entry_cnt = dsize / DIR_ENTRY_SIZE;
+	for(int i=0;i < dir_entry_cnt;i++) 
+	{
+		if (root[i].inode != INODE_FREE) dir_index_add(i);
+	}
+	return 0;
+}
+
 int dir_update(int fid)
 {
 	// check params
 	if (!root) return -1;
+	if (dir_size() < 0) return -1; // error
 
-	int dir_entry_cnt = inodes[sblock.inodeRoot].size / DIR_ENTRY_SIZE;
+	int dir_entry_cnt = dir_size() / DIR_ENTRY_SIZE;
 	if (fid < 0) return -1; // wrong fid
 	if (fid >= dir_entry_cnt) return -1;
 
+	// directory block is already allocated - rewrite it in block cache
 	int dirblk = fid / BLOCK_DIR_ENTRIES;
-	int ret = i_write(sblock.inodeRoot, dirblk * BLOCK_SIZE, (char *)&root[dirblk * BLOCK_DIR_ENTRIES], BLOCK_SIZE);
-	if ((ret < 0) || (ret != BLOCK_SIZE)) return -1; // error
+	block_t blk = i_getblk(sblock.inodeRoot, dirblk);
+	if (blk < 0) return -1; // error
+	if (bc_write(blk, &root[dirblk * BLOCK_DIR_ENTRIES]) < 0) return -1; // error
 	
 	return 0;
 }
@@ -27,24 +122,18 @@ int dir_getfileid(const char* fname)
 	if (!fname) return -1;
 	if (strlen(fname) > MAX_FNAME_LENGTH) return -1; // fname too long
 	
-	int dir_entry_cnt = inodes[sblock.inodeRoot].size / DIR_ENTRY_SIZE;
-	
-	for(int i=0;i < dir_entry_cnt;i++) 
-	{
-                // return direcory index if names equals
-		if ((root[i].inode != INODE_FREE) && !strcmp(root[i].filename, fname)) 
-		{
-			return i;
-		}
-	}
-	return -1; // file not found
+	// return direcory index if names equals
+	int slot = dir_hashslot(fname);
+	if (dir_hash[slot] == DIR_HASH_EMPTY) return -1; // file not found
+	return dir_hash[slot] - 1;
 }
 
 // returns first free entry
 int dir_getfreeid()
 {
 	int i;
-	int dir_entry_cnt = inodes[sblock.inodeRoot].size / DIR_ENTRY_SIZE;
+	if (dir_size() < 0) return -1; // error
+	int dir_entry_cnt = dir_size() / DIR_ENTRY_SIZE;
 
 	if (!root)  // create root if not exists
 	{
@@ -66,7 +155,7 @@ int dir_getfreeid()
 	}
 	
 	// append new directory block if need
-	int oldsz = inodes[sblock.inodeRoot].size;
+	int oldsz = dir_size();
 	int oldcnt = oldsz / DIR_ENTRY_SIZE;
 	root = realloc(root, oldsz + BLOCK_SIZE);
 	memset(&root[oldcnt], 0, BLOCK_SIZE);
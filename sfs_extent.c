@@ -0,0 +1,592 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "sfs.h"
+
+
+#define min(a,b)        ((a < b) ? a : b)
+#define max(a,b)        ((a > b) ? a : b)
+// index tree levels, INDEX_ENTRIES^4 extents blocks are more than any file has
+#define INDEX_MAX_LEVEL	3
+
+
+// reads extents block cid of inode extents chain (0 - first block)
+static int e_chain_read(inode_t inode, int cid, block_t *blk, ExtentBlock *eb)
+{
+	*blk = i_chain(inode, cid, 0);
+	if (*blk == BLOCK_FREE) return -1; // error - chain is too short
+	if (bc_read(*blk + first_data_block, eb) < 0) return -1; // error
+	return 0;
+}
+
+// reads extent k of inode
+static int e_get(inode_t inode, int k, Extent *e)
+{
+	if (k < INODE_EXTENTS) {
+		*e = i_rec(inode)->map.ext.ext[k];
+		return 0;
+	}
+
+	block_t blk;
+	ExtentBlock eb;
+	k -= INODE_EXTENTS;
+	if (e_chain_read(inode, k / BLOCK_EXTENTS, &blk, &eb) < 0) return -1; // error
+	*e = eb.ext[k % BLOCK_EXTENTS];
+	return 0;
+}
+
+// writes extent k of inode, inode record is saved by caller
+static int e_put(inode_t inode, int k, const Extent *e)
+{
+	if (k < INODE_EXTENTS) {
+		i_rec(inode)->map.ext.ext[k] = *e;
+		return 0;
+	}
+
+	block_t blk;
+	ExtentBlock eb;
+	k -= INODE_EXTENTS;
+	if (e_chain_read(inode, k / BLOCK_EXTENTS, &blk, &eb) < 0) return -1; // error
+	eb.ext[k % BLOCK_EXTENTS] = *e;
+	if (bc_write(blk + first_data_block, &eb) < 0) return -1; // error
+	return 0;
+}
+
+// chain blocks under one child of index block of level
+static int e_index_span(int level)
+{
+	int span = 1;
+	for(int i=0;i < level;i++) span *= INDEX_ENTRIES;
+	return span;
+}
+
+// writes empty index block, returns it or BLOCK_FREE for error
+static block_t e_index_alloc(int level, ExtentIndex *node)
+{
+	block_t blk = b_alloc_one();
+	if (blk == BLOCK_FREE) return BLOCK_FREE; // error - disk full
+
+	memset(node, 0, sizeof(*node));
+	node->level = level;
+	if (bc_write(blk + first_data_block, node) < 0) {
+		b_free(blk);
+		return BLOCK_FREE; // error
+	}
+	return blk;
+}
+
+// adds extents block cid to index tree, blocks before it are in the tree already
+// inode record is saved by caller
+static int e_index_add(inode_t inode, int cid, block_t blk, int lblk)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+	ExtentIndex node;
+
+	// first extents block - root is level 0 block
+	if (m->index == BLOCK_FREE) {
+		if (cid != 0) return -1; // error - broken tree
+		m->index = e_index_alloc(0, &node);
+		if (m->index == BLOCK_FREE) return -1; // error
+	}
+
+	// full tree gets new root above the old one
+	if (bc_read(m->index + first_data_block, &node) < 0) return -1; // error
+	if ((node.level < 0) || (node.level > INDEX_MAX_LEVEL)) return -1; // error - broken tree
+	if (cid == e_index_span(node.level + 1)) {
+		if (node.level == INDEX_MAX_LEVEL) return -1; // error - file is too fragmented
+		int lblk0 = node.ent[0].lblk;
+		block_t root = e_index_alloc(node.level + 1, &node);
+		if (root == BLOCK_FREE) return -1; // error
+		node.count = 1;
+		node.ent[0].lblk = lblk0;
+		node.ent[0].blk = m->index;
+		if (bc_write(root + first_data_block, &node) < 0) return -1; // error
+		m->index = root;
+	}
+
+	// path to level 0 block of cid, missing blocks are added on the right
+	block_t cur = m->index;
+	int first = 0;
+	for(;;)
+	{
+		if (bc_read(cur + first_data_block, &node) < 0) return -1; // error
+		if (node.level == 0) break;
+
+		int span = e_index_span(node.level);
+		int i = (cid - first) / span;
+		if (i > node.count) return -1; // error - broken tree
+		if (i == node.count) {
+			ExtentIndex child;
+			block_t nb = e_index_alloc(node.level - 1, &child);
+			if (nb == BLOCK_FREE) return -1; // error
+			node.ent[i].lblk = lblk;
+			node.ent[i].blk = nb;
+			node.count++;
+			if (bc_write(cur + first_data_block, &node) < 0) return -1; // error
+		}
+		first += i * span;
+		cur = node.ent[i].blk;
+	}
+
+	if (node.count != cid - first) return -1; // error - broken tree
+	node.ent[node.count].lblk = lblk;
+	node.ent[node.count].blk = blk;
+	node.count++;
+	return bc_write(cur + first_data_block, &node);
+}
+
+int e_index_leaf(inode_t inode, int cid, int blkid, ExtentIndex *leaf, int *base)
+{
+	block_t cur = i_rec(inode)->map.ext.index;
+	if (cur == BLOCK_FREE) return -1; // error - no extents blocks
+
+	int first = 0;
+	for(;;)
+	{
+		if (bc_read(cur + first_data_block, leaf) < 0) return -1; // error
+		if ((leaf->level < 0) || (leaf->level > INDEX_MAX_LEVEL)) return -1; // error - broken tree
+		if ((leaf->count <= 0) || (leaf->count > (int)INDEX_ENTRIES)) return -1; // error - broken tree
+		if (leaf->level == 0) break;
+
+		// child by chain block id or by its first file block
+		int span = e_index_span(leaf->level);
+		int i;
+		if (cid >= 0) i = (cid - first) / span;
+		else {
+			int lo = 0, hi = leaf->count - 1;
+			while (lo < hi)
+			{
+				int mid = (lo + hi + 1) / 2;
+				if (blkid < leaf->ent[mid].lblk) hi = mid - 1;
+				else lo = mid;
+			}
+			i = lo;
+		}
+		if (i >= leaf->count) return -1; // error - block is not in tree
+		first += i * span;
+		cur = leaf->ent[i].blk;
+	}
+	*base = first;
+	return 0;
+}
+
+// sets first file blocks of index entries of chain blocks from cid on, they change when extents move
+// returns first file block mapped under index block blk, -1 for error
+static int e_index_fix(block_t blk, int first, int cid)
+{
+	ExtentIndex node;
+	if (bc_read(blk + first_data_block, &node) < 0) return -1; // error
+	if ((node.level < 0) || (node.level > INDEX_MAX_LEVEL) || (node.count > (int)INDEX_ENTRIES)) return -1; // error - broken tree
+
+	int span = e_index_span(node.level);
+	for(int i=0;i < node.count;i++)
+	{
+		if (first + (i + 1) * span <= cid) continue; // subtree before moved extents
+		if (node.level > 0) {
+			int lblk = e_index_fix(node.ent[i].blk, first + i * span, cid);
+			if (lblk < 0) return -1; // error
+			node.ent[i].lblk = lblk;
+		}
+		else {
+			ExtentBlock eb;
+			if (bc_read(node.ent[i].blk + first_data_block, &eb) < 0) return -1; // error
+			node.ent[i].lblk = eb.ext[0].lblk;
+		}
+	}
+	if (bc_write(blk + first_data_block, &node) < 0) return -1; // error
+	return node.ent[0].lblk;
+}
+
+// frees index block and its index blocks children
+static int e_index_free(block_t blk)
+{
+	ExtentIndex node;
+	if (bc_read(blk + first_data_block, &node) < 0) return -1; // error
+	if ((node.level < 0) || (node.level > INDEX_MAX_LEVEL) || (node.count > (int)INDEX_ENTRIES)) return -1; // error - broken tree
+	if (node.level > 0) {
+		for(int i=0;i < node.count;i++)
+		{
+			if (e_index_free(node.ent[i].blk) < 0) return -1; // error
+		}
+	}
+	return b_free(blk);
+}
+
+// drops index entries of chain blocks from nblk on, index blocks left without entries are freed
+static int e_index_trim(block_t blk, int first, int nblk)
+{
+	ExtentIndex node;
+	if (bc_read(blk + first_data_block, &node) < 0) return -1; // error
+	if ((node.level < 0) || (node.level > INDEX_MAX_LEVEL) || (node.count > (int)INDEX_ENTRIES)) return -1; // error - broken tree
+
+	// children with some chain blocks before nblk stay
+	int span = e_index_span(node.level);
+	int keep = min((nblk - first + span - 1) / span, node.count);
+	for(int i=keep;(node.level > 0) && (i < node.count);i++)
+	{
+		if (e_index_free(node.ent[i].blk) < 0) return -1; // error
+	}
+	if ((node.level > 0) && (keep > 0)) {
+		if (e_index_trim(node.ent[keep - 1].blk, first + (keep - 1) * span, nblk) < 0) return -1; // error
+	}
+	if (keep == node.count) return 0;
+	node.count = keep;
+	return bc_write(blk + first_data_block, &node);
+}
+
+// adds extent to the end of inode block map
+static int e_push(inode_t inode, const Extent *e)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+	int lblk = e->lblk;
+	int k = m->count;
+	if ((k < INODE_EXTENTS) || ((k - INODE_EXTENTS) % BLOCK_EXTENTS != 0))
+	{
+		// free slot in inode record or last extents block
+		m->count++;
+		if (e_put(inode, k, e) < 0) {
+			m->count--;
+			return -1; // error
+		}
+		return 0;
+	}
+
+	// needs new extents block
+	block_t nb = b_alloc_one();
+	if (nb == BLOCK_FREE) return -1; // error - disk full
+
+	ExtentBlock eb;
+	memset(&eb, 0, sizeof(eb));
+	eb.ext[0] = *e;
+	eb.next = BLOCK_FREE;
+	if (bc_write(nb + first_data_block, &eb) < 0) {
+		b_free(nb);
+		return -1; // error
+	}
+
+	// index it, then link it to the chain
+	int cid = (k - INODE_EXTENTS) / BLOCK_EXTENTS;
+	if ((sblock.version >= SFS_VERSION_TREE) && (e_index_add(inode, cid, nb, lblk) < 0)) {
+		b_free(nb);
+		return -1; // error
+	}
+	if (k == INODE_EXTENTS) m->next = nb;
+	else {
+		block_t blk;
+		if (e_chain_read(inode, cid - 1, &blk, &eb) < 0) {
+			b_free(nb);
+			return -1; // error
+		}
+		eb.next = nb;
+		if (bc_write(blk + first_data_block, &eb) < 0) return -1; // error
+	}
+	i_chain_add(inode, cid, nb, lblk);
+	m->count++;
+	return 0;
+}
+
+// adds extent k before extent which is there now, inode record is saved by caller
+static int e_insert(inode_t inode, int k, const Extent *e)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+	int n = m->count;
+	if ((k < 0) || (k > n)) return -1; // error
+	if (k == n) return e_push(inode, e);
+
+	// full map gets new extents block and maybe index blocks for its last extent
+	if ((n >= INODE_EXTENTS) && ((n - INODE_EXTENTS) % BLOCK_EXTENTS == 0) && (b_freecount() < INDEX_MAX_LEVEL + 2)) return -1; // error - disk full
+
+	// extents after k move by one, last extent of full record or block goes to the next one
+	Extent in = *e, out;
+	if (k < INODE_EXTENTS) {
+		int used = min(n, INODE_EXTENTS);
+		out = m->ext[INODE_EXTENTS - 1];
+		memmove(&m->ext[k + 1], &m->ext[k], (min(used, INODE_EXTENTS - 1) - k) * sizeof(Extent));
+		m->ext[k] = in;
+		if (used < INODE_EXTENTS) {
+			m->count++;
+			return 0;
+		}
+		in = out;
+		k = INODE_EXTENTS;
+	}
+
+	int cid = (k - INODE_EXTENTS) / BLOCK_EXTENTS;
+	int fix = cid;
+	int pos = (k - INODE_EXTENTS) % BLOCK_EXTENTS;
+	for(;;cid++,pos = 0)
+	{
+		int used = n - INODE_EXTENTS - cid * BLOCK_EXTENTS;
+		if (used <= 0) {
+			// last block was full
+			if (e_push(inode, &in) < 0) return -1; // error
+			break;
+		}
+		if (used > (int)BLOCK_EXTENTS) used = BLOCK_EXTENTS;
+
+		block_t blk;
+		ExtentBlock eb;
+		if (e_chain_read(inode, cid, &blk, &eb) < 0) return -1; // error
+		out = eb.ext[BLOCK_EXTENTS - 1];
+		memmove(&eb.ext[pos + 1], &eb.ext[pos], (min(used, (int)BLOCK_EXTENTS - 1) - pos) * sizeof(Extent));
+		eb.ext[pos] = in;
+		if (bc_write(blk + first_data_block, &eb) < 0) return -1; // error
+		if (used < (int)BLOCK_EXTENTS) {
+			m->count++;
+			break;
+		}
+		in = out;
+	}
+
+	// first file blocks of moved extents blocks are stale in index and chain
+	if ((sblock.version >= SFS_VERSION_TREE) && (m->index != BLOCK_FREE)) {
+		if (e_index_fix(m->index, 0, fix) < 0) return -1; // error
+	}
+	i_chain_reset(inode);
+	return 0;
+}
+
+// adds run of data blocks at file block lblk before extent k, it continues extent k-1 if it can
+// inode record is saved by caller
+static int e_add(inode_t inode, int k, int lblk, block_t start, int len)
+{
+	Extent e;
+	if (k > 0)
+	{
+		if (e_get(inode, k - 1, &e) < 0) return -1; // error
+		if ((e.lblk + e.len == lblk) && (e.start + e.len == start)) {
+			e.len += len;
+			return e_put(inode, k - 1, &e);
+		}
+	}
+
+	e.lblk = lblk;
+	e.start = start;
+	e.len = len;
+	return e_insert(inode, k, &e);
+}
+
+void e_init(ExtentMap *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->count = 0;
+	m->next = BLOCK_FREE;
+	m->index = BLOCK_FREE;
+}
+
+// finds extent k which maps blkid or first extent after it
+// returns absolute block number or BLOCK_HOLE and sets len like e_getrun
+static block_t e_lookup(inode_t inode, int blkid, int *pk, int *len)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+	Extent *ext = m->ext;
+	int n = min(m->count, INODE_EXTENTS);
+	int base = 0;
+
+	// block is past inode record extents - binary search of extents block by its first file block
+	ExtentBlock eb;
+	if ((m->count > INODE_EXTENTS) && (blkid >= ext[n-1].lblk + ext[n-1].len))
+	{
+		int rest = m->count - INODE_EXTENTS;
+		int cid = i_chain_find(inode, (rest + BLOCK_EXTENTS - 1) / BLOCK_EXTENTS, blkid);
+		if (cid < 0) return -1; // error
+		block_t blk;
+		if (e_chain_read(inode, cid, &blk, &eb) < 0) return -1; // error
+		ext = eb.ext;
+		n = min(rest - cid * (int)BLOCK_EXTENTS, (int)BLOCK_EXTENTS);
+		base = INODE_EXTENTS + cid * BLOCK_EXTENTS;
+	}
+
+	// binary search of extent with block
+	int lo = 0, hi = n - 1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (blkid < ext[mid].lblk) hi = mid - 1;
+		else if (blkid >= ext[mid].lblk + ext[mid].len) lo = mid + 1;
+		else {
+			*pk = base + mid;
+			if (len) *len = ext[mid].lblk + ext[mid].len - blkid;
+			return first_data_block + ext[mid].start + (blkid - ext[mid].lblk);
+		}
+	}
+
+	// hole until next extent, past the last one it has no end
+	*pk = base + lo;
+	if (len) {
+		*len = INT_MAX - blkid;
+		Extent next;
+		if (lo < n) next = ext[lo];
+		else if (base + lo >= m->count) return BLOCK_HOLE;
+		else if (e_get(inode, base + lo, &next) < 0) return -1; // error
+		*len = next.lblk - blkid;
+	}
+	return BLOCK_HOLE;
+}
+
+block_t e_getrun(inode_t inode, int blkid, int *len)
+{
+	int k;
+	return e_lookup(inode, blkid, &k, len);
+}
+
+int e_fill(inode_t inode, int first, int last)
+{
+	// disk full is checked before any hole is filled
+	int need = i_holes(inode, first, last);
+	if (need < 0) return -1; // error
+	if (need == 0) return 0; // blocks are already allocated
+	if (need > b_freecount()) return -1; // error - disk full
+
+	int ret = 0;
+	for(int cur = first;(cur <= last) && (ret == 0);)
+	{
+		int k, run;
+		block_t blk = e_lookup(inode, cur, &k, &run);
+		if (blk >= 0) {
+			cur += run;
+			continue;
+		}
+		if (blk != BLOCK_HOLE) return -1; // error
+		if (run > last - cur + 1) run = last - cur + 1;
+
+		// new runs should follow the extent before the hole on disk
+		block_t goal = BLOCK_FREE;
+		if (k > 0)
+		{
+			Extent prev;
+			if (e_get(inode, k - 1, &prev) < 0) return -1; // error
+			goal = prev.start + prev.len;
+		}
+		while (run > 0)
+		{
+			int len;
+			block_t start = b_alloc_run(goal, run, &len);
+			if (start == BLOCK_FREE) {
+				ret = -1; // error - disk full
+				break;
+			}
+			int cnt = i_rec(inode)->map.ext.count;
+			if (e_add(inode, k, cur, start, len) < 0) {
+				b_free_run(start, len);
+				ret = -1; // error
+				break;
+			}
+			// run merged with extent k-1 adds no extent
+			if (i_rec(inode)->map.ext.count > cnt) k++;
+			cur += len;
+			run -= len;
+			goal = start + len;
+		}
+	}
+
+	// blocks mapped before an error stay allocated
+	if (i_update(inode) < 0) return -1; // error
+	return ret;
+}
+
+int e_free(inode_t inode)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+
+	// inode record extents
+	int n = min(m->count, INODE_EXTENTS);
+	for(int i=0;i < n;i++)
+	{
+		if (b_free_run(m->ext[i].start, m->ext[i].len) < 0) return -1; // error
+	}
+
+	// extents blocks
+	int rest = m->count - n;
+	int next = m->next;
+	ExtentBlock eb;
+	while ((rest > 0) && (next != BLOCK_FREE))
+	{
+		if (bc_read(next + first_data_block, &eb) < 0) return -1; // error
+		n = min(rest, (int)BLOCK_EXTENTS);
+		for(int i=0;i < n;i++)
+		{
+			if (b_free_run(eb.ext[i].start, eb.ext[i].len) < 0) return -1; // error
+		}
+		if (b_free(next) < 0) return -1; // error
+		rest -= n;
+		next = eb.next;
+	}
+
+	// index blocks
+	if ((sblock.version >= SFS_VERSION_TREE) && (m->index != BLOCK_FREE)) {
+		if (e_index_free(m->index) < 0) return -1; // error
+	}
+
+	i_chain_reset(inode);
+	e_init(m);
+	return 0;
+}
+
+int e_truncate(inode_t inode, int fblks)
+{
+	ExtentMap *m = &i_rec(inode)->map.ext;
+	if (fblks <= 0) return e_free(inode);
+
+	// extent k is the first one with blocks from fblks
+	int k, run;
+	block_t blk = e_lookup(inode, fblks, &k, &run);
+	if ((blk < 0) && (blk != BLOCK_HOLE)) return -1; // error
+	if (k >= m->count) return 0; // no blocks past fblks
+
+	// extent across fblks keeps its head
+	Extent e;
+	if (e_get(inode, k, &e) < 0) return -1; // error
+	if (e.lblk < fblks) {
+		int keep = fblks - e.lblk;
+		if (b_free_run(e.start + keep, e.len - keep) < 0) return -1; // error
+		e.len = keep;
+		if (e_put(inode, k, &e) < 0) return -1; // error
+		k++;
+	}
+
+	// extents from k of inode record
+	int n = m->count;
+	for(int i=k;i < min(n, INODE_EXTENTS);i++)
+	{
+		if (b_free_run(m->ext[i].start, m->ext[i].len) < 0) return -1; // error
+	}
+
+	// extents from k of extents blocks, blocks after the last kept one are freed
+	int nblk = (k > INODE_EXTENTS) ? (k - INODE_EXTENTS + BLOCK_EXTENTS - 1) / BLOCK_EXTENTS : 0;
+	int old_nblk = (n > INODE_EXTENTS) ? (n - INODE_EXTENTS + BLOCK_EXTENTS - 1) / BLOCK_EXTENTS : 0;
+	for(int cid=max(0, nblk - 1);cid < old_nblk;cid++)
+	{
+		block_t cblk;
+		ExtentBlock eb;
+		if (e_chain_read(inode, cid, &cblk, &eb) < 0) return -1; // error
+		int lo = INODE_EXTENTS + cid * BLOCK_EXTENTS;
+		for(int i=max(k, lo);i < min(n, lo + (int)BLOCK_EXTENTS);i++)
+		{
+			if (b_free_run(eb.ext[i - lo].start, eb.ext[i - lo].len) < 0) return -1; // error
+		}
+		if (cid >= nblk) {
+			if (b_free(cblk) < 0) return -1; // error
+		}
+		else if (eb.next != BLOCK_FREE) {
+			eb.next = BLOCK_FREE;
+			if (bc_write(cblk + first_data_block, &eb) < 0) return -1; // error
+		}
+	}
+	if (nblk == 0) m->next = BLOCK_FREE;
+
+	// index blocks of freed extents blocks
+	if ((sblock.version >= SFS_VERSION_TREE) && (m->index != BLOCK_FREE) && (nblk < old_nblk)) {
+		if (nblk == 0) {
+			if (e_index_free(m->index) < 0) return -1; // error
+			m->index = BLOCK_FREE;
+		}
+		else if (e_index_trim(m->index, 0, nblk) < 0) return -1; // error
+	}
+
+	i_chain_reset(inode);
+	m->count = k;
+	return 0;
+}
+
@@ -0,0 +1,470 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs.h"
+
+
+// resident inode table blocks
+#define IC_BLOCKS		256
+#define IC_NONE			-1
+// inode table blocks read at once by scan of image without inode bitmap
+#define IM_SCAN_BLOCKS	64
+
+// known map blocks chain of record - pointers blocks or extents blocks after the record
+// chain only grows while file is written, it is emptied when its blocks are freed
+// walked chains are known from the start, chains with index tree are known by index blocks
+typedef struct {
+	int cnt;			// entries in arrays, unknown ones are BLOCK_FREE
+	int known;			// known entries
+	int cap;			// size of arrays
+	block_t *blk;		// chain blocks, relative to first_data_block
+	int *lblk;			// first file block mapped by each chain block
+	block_t next;		// next pointer of block cnt - 1 of walked chain
+} IChain;
+
+// resident inode table block
+// records are written through to the block cache by i_update, so slots are never dirty
+// used & size of records are kept in ic_mem, record copies are used for block maps
+typedef struct {
+	int blk;			// inode table block, IC_NONE if slot is empty
+	int pins;			// users of block records, pinned block is not evicted
+	int prev, next;		// LRU list of unpinned slots, head is most recently used
+	// inode locks - readers share inode, writer changes its size & block map
+	// lock is used only by pinning threads, so it is free when slot is reused
+	pthread_rwlock_t locks[INODES_PER_BLOCK];
+	// chains are filled by readers too, so they have own locks
+	pthread_mutex_t chain_locks[INODES_PER_BLOCK];
+	IChain chain[INODES_PER_BLOCK];
+	INode rec[INODES_PER_BLOCK];
+} ICBlock;
+
+static ICBlock ic[IC_BLOCKS];
+// in-memory inodes of slots, record j of slot id is at id * INODES_PER_BLOCK + j
+static INodeMem ic_mem[IC_BLOCKS * INODES_PER_BLOCK];
+// slot + 1 of each inode table block, 0 if block is not resident
+static int *ic_slot = 0;
+static int ic_blocks = 0;
+static int lru_head = IC_NONE;
+static int lru_tail = IC_NONE;
+// source of unique generations, pointers blocks kept by threads become stale after reload & remount
+static int ic_gen = 0;
+static int ic_ready = 0;
+// guards slots & their pins, records are guarded by inode locks
+static pthread_mutex_t ic_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void lru_unlink(int id)
+{
+	if (ic[id].prev != IC_NONE) ic[ic[id].prev].next = ic[id].next;
+	else lru_head = ic[id].next;
+	if (ic[id].next != IC_NONE) ic[ic[id].next].prev = ic[id].prev;
+	else lru_tail = ic[id].prev;
+}
+
+static void lru_push_head(int id)
+{
+	ic[id].prev = IC_NONE;
+	ic[id].next = lru_head;
+	if (lru_head != IC_NONE) ic[lru_head].prev = id;
+	lru_head = id;
+	if (lru_tail == IC_NONE) lru_tail = id;
+}
+
+int i_init()
+{
+	if (!ic_ready) {
+		for(int i=0;i < IC_BLOCKS;i++)
+		{
+			for(int j=0;j < INODES_PER_BLOCK;j++) 
+			{
+				pthread_rwlock_init(&ic[i].locks[j], 0);
+				pthread_mutex_init(&ic[i].chain_locks[j], 0);
+			}
+		}
+		ic_ready = 1;
+	}
+
+	// all slots are empty, nothing is pinned between mounts
+	lru_head = lru_tail = IC_NONE;
+	for(int i=0;i < IC_BLOCKS;i++)
+	{
+		ic[i].blk = IC_NONE;
+		ic[i].pins = 0;
+		lru_push_head(i);
+	}
+
+	free(ic_slot);
+	ic_blocks = sblock.inodeBlks;
+	ic_slot = calloc(ic_blocks, sizeof(int));
+	if (!ic_slot) return -1; // memory full
+	return 0;
+}
+
+// loads inode table block into least recently used unpinned slot, called with ic_lock held
+static int ic_load(int blk)
+{
+	int id = lru_tail;
+	if (id == IC_NONE) return IC_NONE; // error - all blocks are pinned
+
+	byte_t data[BLOCK_SIZE];
+	if (bc_read(blk + 1, data) < 0) return IC_NONE; // error
+
+	if (ic[id].blk != IC_NONE) ic_slot[ic[id].blk] = 0;
+	ic[id].blk = blk;
+	memcpy(ic[id].rec, data, sizeof(ic[id].rec));
+	for(int j=0;j < INODES_PER_BLOCK;j++)
+	{
+		INodeMem *m = &ic_mem[id * INODES_PER_BLOCK + j];
+		m->used = ic[id].rec[j].used;
+		m->size = ic[id].rec[j].size;
+		m->gen = __sync_add_and_fetch(&ic_gen, 1);
+		ic[id].chain[j].cnt = 0;
+		ic[id].chain[j].known = 0;
+	}
+	ic_slot[blk] = id + 1;
+	return id;
+}
+
+int i_get(inode_t inode)
+{
+	if ((inode < 0) || (inode >= ic_blocks * INODES_PER_BLOCK)) return -1; // error
+
+	int blk = inode / INODES_PER_BLOCK;
+	pthread_mutex_lock(&ic_lock);
+	int id = ic_slot[blk] - 1;
+	if (id == IC_NONE) {
+		id = ic_load(blk);
+		if (id == IC_NONE) {
+			pthread_mutex_unlock(&ic_lock);
+			return -1; // error
+		}
+	}
+	if (ic[id].pins++ == 0) lru_unlink(id);
+	pthread_mutex_unlock(&ic_lock);
+	return 0;
+}
+
+void i_put(inode_t inode)
+{
+	int blk = inode / INODES_PER_BLOCK;
+	pthread_mutex_lock(&ic_lock);
+	int id = ic_slot[blk] - 1;
+	if ((id != IC_NONE) && (--ic[id].pins == 0)) lru_push_head(id);
+	pthread_mutex_unlock(&ic_lock);
+}
+
+INode *i_rec(inode_t inode)
+{
+	if ((inode < 0) || (inode >= ic_blocks * INODES_PER_BLOCK)) return 0;
+
+	// slot of pinned block does not change
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	if (id == IC_NONE) return 0;
+	return &ic[id].rec[inode % INODES_PER_BLOCK];
+}
+
+INodeMem *i_mem(inode_t inode)
+{
+	if ((inode < 0) || (inode >= ic_blocks * INODES_PER_BLOCK)) return 0;
+
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	if (id == IC_NONE) return 0;
+	return &ic_mem[id * INODES_PER_BLOCK + inode % INODES_PER_BLOCK];
+}
+
+int i_gen(inode_t inode)
+{
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	return ic_mem[id * INODES_PER_BLOCK + inode % INODES_PER_BLOCK].gen;
+}
+
+void i_gen_bump(inode_t inode)
+{
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	ic_mem[id * INODES_PER_BLOCK + inode % INODES_PER_BLOCK].gen = __sync_add_and_fetch(&ic_gen, 1);
+}
+
+int i_rdlock(inode_t inode)
+{
+	if (i_get(inode) < 0) return -1; // error
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	pthread_rwlock_rdlock(&ic[id].locks[inode % INODES_PER_BLOCK]);
+	return 0;
+}
+
+int i_wrlock(inode_t inode)
+{
+	if (i_get(inode) < 0) return -1; // error
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	pthread_rwlock_wrlock(&ic[id].locks[inode % INODES_PER_BLOCK]);
+	return 0;
+}
+
+void i_unlock(inode_t inode)
+{
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	pthread_rwlock_unlock(&ic[id].locks[inode % INODES_PER_BLOCK]);
+	i_put(inode);
+}
+
+// chain of pinned inode
+static IChain *ic_chain(inode_t inode, pthread_mutex_t **lock)
+{
+	int id = ic_slot[inode / INODES_PER_BLOCK] - 1;
+	*lock = &ic[id].chain_locks[inode % INODES_PER_BLOCK];
+	return &ic[id].chain[inode % INODES_PER_BLOCK];
+}
+
+// sets entry cid, arrays grow with unknown entries
+static int ic_chain_set(IChain *c, int cid, block_t blk, int lblk)
+{
+	if (cid >= c->cap) {
+		int cap = c->cap ? c->cap : 16;
+		while (cap <= cid) cap *= 2;
+		block_t *b = realloc(c->blk, cap * sizeof(block_t));
+		if (b) c->blk = b;
+		int *l = realloc(c->lblk, cap * sizeof(int));
+		if (l) c->lblk = l;
+		if (!b || !l) return -1; // memory full
+		c->cap = cap;
+	}
+	while (c->cnt <= cid) c->blk[c->cnt++] = BLOCK_FREE;
+	if (c->blk[cid] == BLOCK_FREE) c->known++;
+	c->blk[cid] = blk;
+	c->lblk[cid] = lblk;
+	return 0;
+}
+
+static void ic_chain_clear(IChain *c)
+{
+	c->cnt = 0;
+	c->known = 0;
+}
+
+// entries of level 0 index block with entry cid, or with block mapping blkid if cid < 0
+// sets first to id of its first entry and returns number of its entries
+static int ic_chain_leaf(IChain *c, inode_t inode, int cid, int blkid, int *first)
+{
+	ExtentIndex leaf;
+	if (e_index_leaf(inode, cid, blkid, &leaf, first) < 0) return -1; // error
+	for(int i=0;i < leaf.count;i++)
+	{
+		if (ic_chain_set(c, *first + i, leaf.ent[i].blk, leaf.ent[i].lblk) < 0) return -1; // error
+	}
+	return leaf.count;
+}
+
+// walks chain from its last known block to block cid
+static int ic_chain_walk(IChain *c, INode *ip, int cid)
+{
+	while (c->cnt <= cid)
+	{
+		block_t next;
+		if (c->cnt == 0) next = (sblock.version == SFS_VERSION_BLKPTR) ? ip->map.ptr.next : ip->map.ext.next;
+		else next = c->next;
+		if (next == BLOCK_FREE) return -1; // chain is shorter
+
+		byte_t data[BLOCK_SIZE];
+		if (bc_read(next + first_data_block, data) < 0) return -1; // error
+		int first;
+		block_t after;
+		if (sblock.version == SFS_VERSION_BLKPTR) {
+			first = sizeof(ip->map.ptr.blocks) / sizeof(blkptr_t) + c->cnt * (BLKPTR_PER_BLOCK - 1);
+			after = ((blkptr_t *)data)[BLKPTR_PER_BLOCK - 1];
+		}
+		else {
+			first = ((ExtentBlock *)data)->ext[0].lblk;
+			after = ((ExtentBlock *)data)->next;
+		}
+		if (ic_chain_set(c, c->cnt, next, first) < 0) return -1; // error
+		c->next = after;
+	}
+	return 0;
+}
+
+block_t i_chain(inode_t inode, int cid, int *lblk)
+{
+	if (cid < 0) return BLOCK_FREE;
+
+	pthread_mutex_t *lock;
+	IChain *c = ic_chain(inode, &lock);
+	block_t ret = BLOCK_FREE;
+	pthread_mutex_lock(lock);
+
+	// unknown blocks are read once
+	// index tree gives block with its siblings, other chains are walked by next pointers
+	if ((cid >= c->cnt) || (c->blk[cid] == BLOCK_FREE))
+	{
+		int first;
+		int r = (sblock.version >= SFS_VERSION_TREE) ? ic_chain_leaf(c, inode, cid, 0, &first) : ic_chain_walk(c, i_rec(inode), cid);
+		if ((r < 0) || (cid >= c->cnt)) goto out; // error
+	}
+	ret = c->blk[cid];
+	if (lblk) *lblk = c->lblk[cid];
+out:
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+int i_chain_find(inode_t inode, int nblk, int blkid)
+{
+	if (nblk <= 0) return -1; // error
+
+	pthread_mutex_t *lock;
+	IChain *c = ic_chain(inode, &lock);
+	int ret = -1;
+	pthread_mutex_lock(lock);
+
+	// index tree gives level 0 block of blkid, walked chains are known up to binary search probes
+	int lo = 0, hi = nblk - 1;
+	if ((sblock.version >= SFS_VERSION_TREE) && (c->known < nblk))
+	{
+		int n = ic_chain_leaf(c, inode, -1, blkid, &lo);
+		if (n <= 0) goto out; // error
+		if (lo + n - 1 < hi) hi = lo + n - 1;
+	}
+	// last block which maps blocks from lblk <= blkid
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if ((mid >= c->cnt) && (ic_chain_walk(c, i_rec(inode), mid) < 0)) goto out; // error
+		if (blkid < c->lblk[mid]) hi = mid - 1;
+		else lo = mid;
+	}
+	if ((lo >= c->cnt) && (sblock.version < SFS_VERSION_TREE) && (ic_chain_walk(c, i_rec(inode), lo) < 0)) goto out; // error
+	if ((lo < c->cnt) && (c->blk[lo] != BLOCK_FREE)) ret = lo;
+out:
+	pthread_mutex_unlock(lock);
+	return ret;
+}
+
+void i_chain_add(inode_t inode, int cid, block_t blk, int lblk)
+{
+	pthread_mutex_t *lock;
+	IChain *c = ic_chain(inode, &lock);
+	pthread_mutex_lock(lock);
+	if ((cid < c->cnt) && (c->blk[cid] != BLOCK_FREE)) ic_chain_clear(c); // stale chain
+	if (sblock.version >= SFS_VERSION_TREE) {
+		if (ic_chain_set(c, cid, blk, lblk) < 0) ic_chain_clear(c);
+	}
+	// walked block is known when its predecessor is the last known one, other ones are read on use
+	else if (c->cnt == cid) {
+		if (ic_chain_set(c, cid, blk, lblk) < 0) ic_chain_clear(c);
+		c->next = BLOCK_FREE;
+	}
+	pthread_mutex_unlock(lock);
+}
+
+void i_chain_reset(inode_t inode)
+{
+	pthread_mutex_t *lock;
+	IChain *c = ic_chain(inode, &lock);
+	pthread_mutex_lock(lock);
+	ic_chain_clear(c);
+	pthread_mutex_unlock(lock);
+}
+
+// free inode bitmap, bit is set if inode is used
+// bits past last inode are set, they are never allocated
+static bitmap_t *im_map = 0;
+static int im_words = 0;
+// words before im_hint have no free inodes
+static int im_hint = 0;
+
+// inode bitmap word is changed, image with bitmap gets it with next commit
+static int im_save(int word)
+{
+	if (!sblock.inodemapBlks) return 0;
+	block_t blk = sblock.inodemapStart + word / MAX_FREEMAP_ID;
+	int offset = (word % MAX_FREEMAP_ID) * sizeof(bitmap_t);
+	return bc_write_part(blk, offset, &im_map[word], sizeof(bitmap_t));
+}
+
+// sets bits past last inode, bitmap of mounted image is sized by superblock
+static int im_alloc_map()
+{
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+	im_words = (inode_cnt + 31) / 32;
+	int map_words = sblock.inodemapBlks ? sblock.inodemapBlks * MAX_FREEMAP_ID : im_words;
+
+	free(im_map);
+	im_map = calloc(map_words, sizeof(bitmap_t));
+	if (!im_map) return -1; // memory full
+	if (inode_cnt & 0x1f) im_map[im_words - 1] = 0xffffffff << (inode_cnt & 0x1f);
+	im_hint = 0;
+	return 0;
+}
+
+int im_format()
+{
+	if (im_alloc_map() < 0) return -1; // error
+	im_map[sblock.inodeRoot >> 5] |= 1u << (sblock.inodeRoot & 0x1f);
+	if (!sblock.inodemapBlks) return 0;
+
+	int ret = write_blocks(sblock.inodemapStart, sblock.inodemapBlks, im_map);
+	if ((ret < 0) || (ret != sblock.inodemapBlks)) return -1; // error
+	return 0;
+}
+
+int im_init()
+{
+	if (im_alloc_map() < 0) return -1; // error
+	bitmap_t tail = im_map[im_words - 1];
+
+	if (sblock.inodemapBlks) {
+		int ret = read_blocks(sblock.inodemapStart, sblock.inodemapBlks, im_map);
+		if ((ret < 0) || (ret != sblock.inodemapBlks)) return -1; // error
+		im_map[im_words - 1] |= tail;
+		return 0;
+	}
+
+	// image without bitmap - used flags of inode table records
+	INode *recs = malloc(IM_SCAN_BLOCKS * BLOCK_SIZE);
+	if (!recs) return -1; // memory full
+	for(int blk=0;blk < sblock.inodeBlks;blk += IM_SCAN_BLOCKS)
+	{
+		int n = sblock.inodeBlks - blk;
+		if (n > IM_SCAN_BLOCKS) n = IM_SCAN_BLOCKS;
+		int ret = read_blocks(1 + blk, n, recs);
+		if ((ret < 0) || (ret != n)) {
+			free(recs);
+			return -1; // error
+		}
+		for(int i=0;i < n * INODES_PER_BLOCK;i++)
+		{
+			inode_t inode = blk * INODES_PER_BLOCK + i;
+			if (recs[i].used) im_map[inode >> 5] |= 1u << (inode & 0x1f);
+		}
+	}
+	free(recs);
+	return 0;
+}
+
+inode_t im_alloc()
+{
+	for(int w=im_hint;w < im_words;w++)
+	{
+		if (im_map[w] == 0xffffffff) continue;
+		im_hint = w;
+		int bit = __builtin_ctz(~im_map[w]);
+		im_map[w] |= 1u << bit;
+		if (im_save(w) < 0) {
+			im_map[w] &= ~(1u << bit);
+			return -1; // error
+		}
+		return (w << 5) + bit;
+	}
+	im_hint = im_words;
+	return -1; // inodes table is full
+}
+
+void im_free(inode_t inode)
+{
+	if ((inode < 0) || (inode >= ic_blocks * INODES_PER_BLOCK)) return;
+
+	int w = inode >> 5;
+	im_map[w] &= ~(1u << (inode & 0x1f));
+	im_save(w);
+	if (w < im_hint) im_hint = w;
+}
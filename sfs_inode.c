@@ -1,6 +1,8 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "disk_emu.h"
 #include "sfs.h"
@@ -8,106 +10,326 @@
 
 #define max(a,b)        ((a > b) ? a : b)
 
+// max segments collected before a vectored disk request is issued
+#define IO_VEC_MAX		32
+// max blocks taken from allocator by one b_alloc call of i_fill
+#define ALLOC_CHUNK		64
 
+// batch of block transfers issued as one vectored disk request
+typedef struct {
+	blkvec_t vec[IO_VEC_MAX];
+	int nvec;
+	int write;
+} IOBatch;
 
-// inode pointers block
-inode_t last_inode = INODE_FREE;
-inode_t inode_blocks_offset = 0;
-inode_t last_inode_block = -1;
-block_t blocks[BLKPTR_PER_BLOCK];
-
-int i_update(inode_t inode)
+// issues collected segments to disk
+static int io_flush(IOBatch *io)
 {
-	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+	if (io->nvec == 0) return 0;
 
-	// check params
-	if (inode <= INODE_FREE) return -1; // not opened file
-	if (inode >= inode_cnt) return -1;
-	
-	int inodeblk = inode / INODES_PER_BLOCK;
-	int ret = write_blocks(inodeblk+1, 1, &inodes[inodeblk * INODES_PER_BLOCK]);
-	if ((ret < 0) || (ret != 1)) return -1; // error
-	
+	int cnt = 0;
+	for (int i = 0; i < io->nvec; i++) cnt += io->vec[i].nblocks;
+
+	int ret = io->write ? bc_write_v(io->vec, io->nvec) : bc_read_v(io->vec, io->nvec);
+	io->nvec = 0;
+	if ((ret < 0) || (ret != cnt)) return -1; // error
 	return 0;
 }
 
-int fm_update()
+// adds transfer of nblocks blocks, extends last segment if blocks follow it on disk and in memory
+static int io_add(IOBatch *io, block_t blk, int nblocks, void *buf)
 {
-	int ret = write_blocks(freemap_block, 1, freemap);
-	if ((ret < 0) || (ret != 1)) return -1; // error
+	if (io->nvec > 0) {
+		blkvec_t *last = &io->vec[io->nvec - 1];
+		if ((last->start_address + last->nblocks == blk) &&
+			((char *)last->buffer + last->nblocks * BLOCK_SIZE == (char *)buf)) 
+		{
+			last->nblocks += nblocks;
+			return 0;
+		}
+	}
+	
+	if (io->nvec >= IO_VEC_MAX) {
+		if (io_flush(io) < 0) return -1; // error
+	}
+	
+	io->vec[io->nvec].start_address = blk;
+	io->vec[io->nvec].nblocks = nblocks;
+	io->vec[io->nvec].buffer = buf;
+	io->nvec++;
 	return 0;
 }
 
-int b_zero(block_t blk)
+
+
+// pointers per pointers block, last one links next block
+#define BLKPTR_BLOCK_PTRS	(BLKPTR_PER_BLOCK - 1)
+
+// copy of pointers block last used by thread, pointers blocks are found by inode chain
+// generation of inode changes with its block map, it makes copies of other threads stale
+static __thread inode_t last_inode = INODE_FREE;
+static __thread int last_inode_gen = 0;
+static __thread block_t last_inode_block = BLOCK_FREE;
+static __thread blkptr_t blocks[BLKPTR_PER_BLOCK];
+
+// allocator lock - guards freemap and its summary
+static pthread_mutex_t fm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int i_update(inode_t inode)
 {
-	byte_t zerodata[BLOCK_SIZE];
-	memset(zerodata, 0, BLOCK_SIZE);
+	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+
+	// check params
+	if (inode <= INODE_FREE) return -1; // not opened file
+	if (inode >= inode_cnt) return -1;
+	
+	// only own record is copied, other inodes of block may be changed by their writers
+	int inodeblk = inode / INODES_PER_BLOCK;
+	int offset = (inode % INODES_PER_BLOCK) * INODE_ENTRY_SIZE;
+	INode *ip = i_rec(inode);
+	if (!ip) return -1; // not pinned inode
+	ip->used = i_mem(inode)->used;
+	ip->size = i_mem(inode)->size;
+	if (bc_write_part(inodeblk+1, offset, ip, sizeof(INode)) < 0) return -1; // error
 	
-	int ret = write_blocks(blk + first_data_block, 1, zerodata);
-	if ((ret < 0) || (ret != 1)) return -1; // error
 	return 0;
 }
 
-int i_append_blocks(inode_t inode, block_t* new_blocks, int new_blocks_cnt)
+int i_append_blocks(inode_t inode, int fblks, block_t* new_blocks, int new_blocks_cnt)
 {
 	if (new_blocks_cnt <= 0) return -1;
 	
 	int i, newb = 0;
-	int icnt = sizeof(inodes[inode].blocks) / sizeof(block_t);
-	int fblks = (inodes[inode].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	// append blocks to inode record first
-	block_t *bp = inodes[inode].blocks;
-	if (fblks > icnt) 
+	INode *ip = i_rec(inode);
+	int icnt = sizeof(ip->map.ptr.blocks) / sizeof(blkptr_t);
+	// set pointers of inode record first
+	blkptr_t *bp = ip->map.ptr.blocks;
+	blkptr_t pblocks[BLKPTR_PER_BLOCK];
+	int cid = -1; // chain block filled now, -1 for inode record
+	block_t pblk = BLOCK_FREE;
+	if (fblks >= icnt) 
 	{
-		// load pointers block
-		block_t blk = i_getblk(inode, fblks-1);
-		if (blk < 0) return -1; // error
-
-		bp = blocks;
-		icnt = BLKPTR_PER_BLOCK - 1;
-		fblks -= inode_blocks_offset;
+		// load pointers block of fblks, or last one if chain does not reach it
+		cid = (fblks - icnt) / BLKPTR_BLOCK_PTRS;
+		while ((cid >= 0) && ((pblk = i_chain(inode, cid, 0)) == BLOCK_FREE)) cid--;
+		if (cid >= 0) {
+			if (bc_read(pblk + first_data_block, pblocks) < 0) return -1; // error
+			fblks -= icnt + cid * BLKPTR_BLOCK_PTRS;
+			bp = pblocks;
+			icnt = BLKPTR_BLOCK_PTRS;
+		}
 	}
 
-	while(new_blocks_cnt > 0) // append new pointers block
+	while(new_blocks_cnt > 0) // set pointers of next pointers block
 	{
-		for(i=fblks;i < icnt;i++) {
+		for(i=fblks;(i < icnt) && (new_blocks_cnt > 0);i++) {
 			bp[i] = new_blocks[newb]; newb++;
 			new_blocks_cnt--;
-			if (new_blocks_cnt <= 0) break;
 		}
 		
-		// needs to alloc new block ?
-		if (new_blocks_cnt > 0) {
+		// next block is new one, its pointers are holes until they are set
+		int fresh = 0;
+		if ((new_blocks_cnt > 0) && (bp[icnt] == BLOCK_FREE)) {
 			bp[icnt] = b_alloc_one();
-			if (!bp[icnt]) return -1; // error - disk full
-
-			if (fm_update() < 0) return -1; // error
-			if (b_zero(bp[icnt]) < 0) return -1; // error
+			if (bp[icnt] == BLOCK_FREE) return -1; // error - disk full
+			fresh = 1;
 		}
 		
-		if (bp == inodes[inode].blocks) { // save inode entry
+		if (bp == ip->map.ptr.blocks) { // save inode entry
 			if (i_update(inode) < 0) return -1;
 		}
 		else { // save pointers block
-			//int ret = write_blocks(bp[icnt] + first_data_block, 1, blocks);
-			int ret = write_blocks(last_inode_block + first_data_block, 1, blocks);
-			if ((ret < 0) || (ret != 1)) return -1; // error
+			if (bc_write(pblk + first_data_block, pblocks) < 0) return -1; // error
 		}
 		
 		// prepare next block
 		if (new_blocks_cnt > 0) {
-			last_inode_block = bp[icnt];
-			inode_blocks_offset += icnt;
-			memset(blocks, BLOCK_FREE, sizeof(blocks));
-			bp = blocks;
-			icnt = BLKPTR_PER_BLOCK - 1;
-			fblks = 0; // fill from 0
+			pblk = bp[icnt];
+			cid++;
+			if (fresh) {
+				i_chain_add(inode, cid, pblk, 0);
+				memset(pblocks, BLOCK_FREE, sizeof(pblocks));
+			}
+			else if (bc_read(pblk + first_data_block, pblocks) < 0) return -1; // error
+			bp = pblocks;
+			fblks = max(0, fblks - icnt); // fill from 0 or from skipped pointers
+			icnt = BLKPTR_BLOCK_PTRS;
 		}
 	}
+
+	// pointers block copies of threads are stale
+	i_gen_bump(inode);
 	return 0;
 }
 
-int b_free(block_t block)
+// freemap summary - bit is set if freemap word has no free blocks
+static bitmap_t *fm_full = 0;
+// freemap words before fm_hint have no free blocks
+static int fm_hint = 0;
+// blocks of group
+static int fm_group_blocks = FM_GROUP_BLOCKS;
+
+// with journal, blocks freed since last commit are not reused until the commit is on disk
+// pending - freed blocks, committing - freed blocks in commit being written
+static bitmap_t *fm_pending = 0;
+static bitmap_t *fm_committing = 0;
+static int fm_pending_cnt = 0;
+static int fm_committing_cnt = 0;
+// freemap blocks changed since last snapshot, bit per block
+static bitmap_t *fm_dirty_map = 0;
+static int fm_dirty_cnt = 0;
+// copy of freemap for commit & indexes of its changed blocks
+static bitmap_t *fm_copy = 0;
+static int *fm_copy_blks = 0;
+static int fm_copy_cnt = 0;
+// free blocks promised to buffered writes, they are not counted by b_freecount
+static int fm_reserved = 0;
+
+// free map word is changed, its block goes to disk with next commit
+static void fm_dirty(int bmid)
+{
+	int blk = bmid / MAX_FREEMAP_ID;
+	bitmap_t mask = 1u << (blk & 0x1f);
+	if (fm_dirty_map[blk >> 5] & mask) return;
+	fm_dirty_map[blk >> 5] |= mask;
+	fm_dirty_cnt++;
+}
+
+// bits of freemap word past the end of the file system, they are never allocated
+static bitmap_t fm_tail_mask(int bmid)
+{
+	int bits = sblock.fssize - (bmid << 5);
+	if (bits >= 32) return 0;
+	if (bits <= 0) return 0xffffffff;
+	return 0xffffffff << bits;
+}
+
+// blocks of freemap word which can not be allocated
+static bitmap_t fm_used(int bmid)
+{
+	return freemap[bmid] | fm_pending[bmid] | fm_committing[bmid] | fm_tail_mask(bmid);
+}
+
+static void fm_set_full(int bmid, int full)
+{
+	if (full) fm_full[bmid >> 5] |= 1u << (bmid & 0x1f);
+	else fm_full[bmid >> 5] &= ~(1u << (bmid & 0x1f));
+}
+
+// returns first freemap word from bmid with free blocks or -1
+static int fm_next_free(int bmid)
+{
+	int words = (sblock.fssize + 31) >> 5;
+	if (bmid >= words) return -1;
+	
+	int sid = bmid >> 5;
+	bitmap_t free_words = ~fm_full[sid] & (0xffffffff << (bmid & 0x1f));
+	for (;;)
+	{
+		if (free_words) {
+			bmid = (sid << 5) + __builtin_ctz(free_words);
+			return (bmid < words) ? bmid : -1;
+		}
+		sid++;
+		if ((sid << 5) >= words) return -1;
+		free_words = ~fm_full[sid];
+	}
+}
+
+// free blocks of bitmap words lo..hi
+static int fm_count_free(const bitmap_t *bm, int lo, int hi)
+{
+	int used = 0;
+	int i = lo;
+	// two words at once - popcount of 64 bit word is one instruction where cpu has it
+	for(;i+1 <= hi;i+=2) 
+	{
+		unsigned long long w = bm[i] | fm_tail_mask(i);
+		w |= (unsigned long long)(bm[i+1] | fm_tail_mask(i+1)) << 32;
+		used += __builtin_popcountll(w);
+	}
+	if (i <= hi) used += __builtin_popcount(bm[i] | fm_tail_mask(i));
+	return (hi - lo + 1) * 32 - used;
+}
+
+// counts free blocks of group from bitmap
+static int fm_group_count(const bitmap_t *bm, int g)
+{
+	int words = (sblock.fssize + 31) >> 5;
+	int lo = g * (fm_group_blocks / 32);
+	int hi = lo + (fm_group_blocks / 32) - 1;
+	if (hi >= words) hi = words - 1;
+	return fm_count_free(bm, lo, hi);
+}
+
+// returns not 0 if free counts of superblock match its free map size
+static int fm_counts_valid()
+{
+	int groups = (sblock.fssize + fm_group_blocks - 1) / fm_group_blocks;
+	if ((groups > SB_MAX_GROUPS) || (sblock.groups != groups)) return 0;
+
+	int total = 0;
+	for(int g=0;g < groups;g++) 
+	{
+		if ((sblock.groupFree[g] < 0) || (sblock.groupFree[g] > fm_group_blocks)) return 0;
+		total += sblock.groupFree[g];
+	}
+	return total == sblock.freeBlocks;
+}
+
+int fm_init()
+{
+	int words = sblock.freemapBlks * MAX_FREEMAP_ID;
+	fm_group_blocks = sblock.groupBlocks ? sblock.groupBlocks : FM_GROUP_BLOCKS;
+	int groups = (sblock.fssize + fm_group_blocks - 1) / fm_group_blocks;
+
+	// allocator state is sized by free map of this image
+	free(fm_pending);
+	free(fm_committing);
+	free(fm_full);
+	free(fm_dirty_map);
+	free(fm_copy);
+	free(fm_copy_blks);
+	fm_pending = calloc(words, sizeof(bitmap_t));
+	fm_committing = calloc(words, sizeof(bitmap_t));
+	fm_full = calloc((words + 31) / 32, sizeof(bitmap_t));
+	fm_dirty_map = calloc((sblock.freemapBlks + 31) / 32, sizeof(bitmap_t));
+	fm_copy = malloc(words * sizeof(bitmap_t));
+	fm_copy_blks = malloc(sblock.freemapBlks * sizeof(int));
+	if (!fm_pending || !fm_committing || !fm_full || !fm_dirty_map || !fm_copy || !fm_copy_blks) return -1; // memory full
+	fm_pending_cnt = fm_committing_cnt = 0;
+	fm_reserved = 0;
+	fm_dirty_cnt = 0;
+	fm_copy_cnt = 0;
+
+	// image without valid counts - count them now, they are kept with free map
+	if (!fm_counts_valid())
+	{
+		sblock.groups = (groups <= SB_MAX_GROUPS) ? groups : 0;
+		sblock.freeBlocks = 0;
+		for(int g=0;g < groups;g++) 
+		{
+			int n = fm_group_count(freemap, g);
+			if (g < SB_MAX_GROUPS) sblock.groupFree[g] = n;
+			sblock.freeBlocks += n;
+		}
+	}
+	freemap_freeblocks = sblock.freeBlocks;
+
+	// summary words of groups without free blocks are full
+	// words of other groups are checked when they are used
+	int sids = fm_group_blocks / 1024;
+	for(int g=0;g < groups;g++) 
+	{
+		if (!sblock.groups || sblock.groupFree[g]) continue;
+		for(int i=g*sids;(i < (g+1)*sids) && (i < (words + 31) / 32);i++) fm_full[i] = 0xffffffff;
+	}
+	fm_hint = 0;
+	return 0;
+}
+
+// frees block, called with fm_lock held
+static int fm_free(block_t block)
 {
 	// check params
 	if (block < 0) return -1;
@@ -118,136 +340,456 @@ int b_free(block_t block)
 	int bmbit = block & 0x1f;
 
 	bitmap_t bm = freemap[bmid];
-	bitmap_t mask = 1 << bmbit;
+	bitmap_t mask = 1u << bmbit;
 	
 	if ((bm & mask) == 0) return -1; // error - is already free block
 	
 	// free block
 	freemap[bmid] = bm & ~mask;
+	fm_dirty(bmid);
+	if (j_enabled()) {
+		// block stays used until the commit
+		fm_pending[bmid] |= mask;
+		fm_pending_cnt++;
+		return 0;
+	}
 	freemap_freeblocks++;
+	fm_set_full(bmid, 0);
+	if (bmid < fm_hint) fm_hint = bmid;
 	
 	return 0;
 }
 
-// returns array of free blocks
-block_t* b_alloc(int nblocks)
+int b_free(block_t block)
 {
-	if (nblocks <= 0) return 0; // error
-	if (nblocks > freemap_freeblocks) return 0; // error - disk full	
-
-	// save bitmap
-	bitmap_t freemap_save[MAX_FREEMAP_ID];
-	memcpy(freemap_save, freemap, sizeof(freemap_save));
+	pthread_mutex_lock(&fm_lock);
+	int ret = fm_free(block);
+	pthread_mutex_unlock(&fm_lock);
 	
-	// alloc array
-	block_t* free_blocks = malloc(nblocks * sizeof(block_t));
+	// cached content of freed block is useless
+	if (ret == 0) bc_forget(block + first_data_block);
+	return ret;
+}
+
+// fills array of free blocks, called with fm_lock held
+static int fm_alloc(block_t* free_blocks, int nblocks)
+{
+	if (nblocks > freemap_freeblocks) return -1; // error - disk full
 
-	int brest = nblocks;
 	int bptr = 0;
-	for(int i=0;i < sblock.fssize;i++)
+	int bmid = fm_hint;
+	while (bptr < nblocks)
 	{
-		bitmap_t bm = freemap[i];
-		if (bm != 0xffffffff) { // is free blocks ?
-			bitmap_t mask = 1;
-			for(int j=0;j < 32;j++) 
-			{
-				if ((bm & mask) == 0) { // is free block
-					bm |= mask; // alloc block
-                                        // save block number
-					free_blocks[bptr] = (i << 5) + j; bptr++;
-					brest--;
-					if (brest <= 0) break;
-				}
-				mask <<= 1;
-			}
-			freemap[i] = bm; // save bitmap
-			if (brest <= 0) break;
+		bmid = fm_next_free(bmid);
+		if (bmid < 0) break; // disk full
+		
+		bitmap_t bm = freemap[bmid];
+		bitmap_t used = fm_used(bmid);
+		while ((used != 0xffffffff) && (bptr < nblocks))
+		{
+			int j = __builtin_ctz(~used); // first free block
+			used |= 1u << j;
+			bm |= 1u << j; // alloc block
+			free_blocks[bptr] = (bmid << 5) + j; bptr++;
 		}
+		freemap[bmid] = bm; // save bitmap
+		fm_dirty(bmid);
+		if (used == 0xffffffff) fm_set_full(bmid, 1);
+		else break;
 	}
 
-	if (brest > 0) // disk full
+	if (bptr < nblocks) // disk full
 	{
-		// restore bitmap if error
-		memcpy(freemap, freemap_save, sizeof(freemap));
-		free(free_blocks);
-		return 0; // disk is full
+		// release allocated blocks if error
+		for(int i=0;i < bptr;i++) 
+		{
+			int id = free_blocks[i] >> 5;
+			freemap[id] &= ~(1u << (free_blocks[i] & 0x1f));
+			fm_set_full(id, 0);
+		}
+		return -1; // disk is full
 	}
 	else { // all ok
+		// all words before the last used one are full now
+		if (bmid > fm_hint) fm_hint = bmid;
 		freemap_freeblocks -= nblocks;
-		return free_blocks; // disk is OK
+		return 0; // disk is OK
 	}
 }
 
-// returns one free block
-block_t b_alloc_one()
+// returns not 0 if commit would make more blocks free, called with fm_lock held
+static int fm_freed()
+{
+	return fm_pending_cnt + fm_committing_cnt;
+}
+
+int b_alloc(block_t* free_blocks, int nblocks)
 {
-	block_t *fb = b_alloc(1);
-	if (fb) {
-		block_t b = *fb;
-		free(fb);
-		return b;
+	if (nblocks <= 0) return -1; // error
+
+	pthread_mutex_lock(&fm_lock);
+	int ret = fm_alloc(free_blocks, nblocks);
+	int retry = (ret < 0) && fm_freed();
+	pthread_mutex_unlock(&fm_lock);
+
+	// blocks freed by uncommitted operations become free after commit
+	if (retry && (bc_commit() == 0))
+	{
+		pthread_mutex_lock(&fm_lock);
+		ret = fm_alloc(free_blocks, nblocks);
+		pthread_mutex_unlock(&fm_lock);
 	}
-	return 0;
+	return ret;
 }
 
-// returns first free entry
-inode_t i_alloc()
+// returns first free block from block or -1
+static int fm_next_free_block(int block)
 {
-	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
+	if (block >= sblock.fssize) return -1;
 	
-	for(int i=0;i < inode_cnt;i++) 
+	int bmid = block >> 5;
+	bitmap_t used = fm_used(bmid) | ~(0xffffffff << (block & 0x1f));
+	while (used == 0xffffffff) {
+		bmid = fm_next_free(bmid + 1);
+		if (bmid < 0) return -1;
+		used = fm_used(bmid);
+		// summary of word not checked since mount may be stale
+		if (used == 0xffffffff) fm_set_full(bmid, 1);
+	}
+	return (bmid << 5) + __builtin_ctz(~used);
+}
+
+// returns number of free blocks from block, not greater than max
+static int fm_run_len(int block, int max)
+{
+	int len = 0;
+	while ((len < max) && (block + len < sblock.fssize))
+	{
+		int b = block + len;
+		int bmid = b >> 5;
+		int bit = b & 0x1f;
+		bitmap_t used = fm_used(bmid) >> bit;
+		int n = used ? __builtin_ctz(used) : 32 - bit;
+		len += n;
+		if (n < 32 - bit) break; // used block found
+	}
+	return (len < max) ? len : max;
+}
+
+// marks run of blocks as used
+static void fm_mark_run(int block, int len)
+{
+	for(int b=block;b < block+len;b++)
+	{
+		int bmid = b >> 5;
+		freemap[bmid] |= 1u << (b & 0x1f);
+		fm_dirty(bmid);
+		if (fm_used(bmid) == 0xffffffff) fm_set_full(bmid, 1);
+	}
+	freemap_freeblocks -= len;
+}
+
+// allocates run, called with fm_lock held
+static block_t fm_alloc_run(block_t goal, int nblocks, int *len)
+{
+	if (freemap_freeblocks <= 0) return BLOCK_FREE; // error - disk full
+
+	// run continuing at goal keeps file contiguous, even if it is short
+	int n;
+	if ((goal >= 0) && (goal < sblock.fssize) && ((n = fm_run_len(goal, nblocks)) > 0)) 
+	{
+		fm_mark_run(goal, n);
+		*len = n;
+		return goal;
+	}
+
+	// first run long enough, or the longest one if there is no such run
+	int best = -1, best_len = 0;
+	int block = fm_next_free_block(fm_hint << 5);
+	while (block >= 0)
+	{
+		n = fm_run_len(block, nblocks);
+		if (n > best_len) {
+			best = block;
+			best_len = n;
+			if (n >= nblocks) break;
+		}
+		block = fm_next_free_block(block + n);
+	}
+	if (best < 0) return BLOCK_FREE; // error - disk full
+
+	fm_mark_run(best, best_len);
+	*len = best_len;
+	return best;
+}
+
+block_t b_alloc_run(block_t goal, int nblocks, int *len)
+{
+	if (nblocks <= 0) return BLOCK_FREE; // error
+
+	pthread_mutex_lock(&fm_lock);
+	block_t start = fm_alloc_run(goal, nblocks, len);
+	int retry = (start == BLOCK_FREE) && fm_freed();
+	pthread_mutex_unlock(&fm_lock);
+
+	// blocks freed by uncommitted operations become free after commit
+	if (retry && (bc_commit() == 0))
+	{
+		pthread_mutex_lock(&fm_lock);
+		start = fm_alloc_run(goal, nblocks, len);
+		pthread_mutex_unlock(&fm_lock);
+	}
+	return start;
+}
+
+int b_free_run(block_t start, int len)
+{
+	int ret = 0, i;
+	pthread_mutex_lock(&fm_lock);
+	for(i=0;i < len;i++)
+	{
+		if (fm_free(start + i) < 0) {
+			ret = -1; // error
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fm_lock);
+
+	// cached content of freed blocks is useless
+	while (i-- > 0) bc_forget(start + i + first_data_block);
+	return ret;
+}
+
+int b_freecount()
+{
+	pthread_mutex_lock(&fm_lock);
+	int cnt = freemap_freeblocks + fm_freed() - fm_reserved;
+	pthread_mutex_unlock(&fm_lock);
+	return cnt;
+}
+
+int b_reserve(int nblocks, int keep)
+{
+	pthread_mutex_lock(&fm_lock);
+	int ret = -1; // disk full
+	if (nblocks + keep <= freemap_freeblocks + fm_freed() - fm_reserved) {
+		fm_reserved += nblocks;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&fm_lock);
+	return ret;
+}
+
+void b_unreserve(int nblocks)
+{
+	pthread_mutex_lock(&fm_lock);
+	fm_reserved -= nblocks;
+	pthread_mutex_unlock(&fm_lock);
+}
+
+int fm_snapshot(const bitmap_t **buf, int **blks)
+{
+	pthread_mutex_lock(&fm_lock);
+	int words = (sblock.fssize + 31) >> 5;
+	int cnt = 0;
+	for(int w=0;(w < (sblock.freemapBlks + 31) / 32) && (cnt < fm_dirty_cnt);w++) 
+	{
+		while (fm_dirty_map[w])
+		{
+			int blk = (w << 5) + __builtin_ctz(fm_dirty_map[w]);
+			fm_dirty_map[w] &= fm_dirty_map[w] - 1;
+			fm_copy_blks[cnt++] = blk;
+
+			int lo = blk * MAX_FREEMAP_ID;
+			memcpy(&fm_copy[lo], &freemap[lo], BLOCK_SIZE);
+			// blocks freed before the snapshot are free in this copy
+			for(int i=lo;(i < lo + MAX_FREEMAP_ID) && (i < words);i++) 
+			{
+				fm_committing[i] |= fm_pending[i];
+				fm_pending[i] = 0;
+			}
+		}
+	}
+	fm_copy_cnt = cnt;
+	fm_dirty_cnt = 0;
+	fm_committing_cnt += fm_pending_cnt;
+	fm_pending_cnt = 0;
+
+	// recount groups of changed blocks, free counts go to disk with this free map
+	if (sblock.groups) 
+	{
+		int last = -1;
+		for(int k=0;k < cnt;k++)
+		{
+			int g = fm_copy_blks[k] * FREEMAP_BLOCK_BITS / fm_group_blocks;
+			int end = ((fm_copy_blks[k] + 1) * FREEMAP_BLOCK_BITS - 1) / fm_group_blocks;
+			if (end >= sblock.groups) end = sblock.groups - 1;
+			if (g <= last) g = last + 1;
+			for(;g <= end;g++)
+			{
+				int n = fm_group_count(freemap, g);
+				sblock.freeBlocks += n - sblock.groupFree[g];
+				sblock.groupFree[g] = n;
+			}
+			last = end;
+		}
+	}
+	*buf = fm_copy;
+	*blks = fm_copy_blks;
+	pthread_mutex_unlock(&fm_lock);
+	return cnt;
+}
+
+void fm_commit_done()
+{
+	pthread_mutex_lock(&fm_lock);
+	int words = (sblock.fssize + 31) >> 5;
+	// blocks freed before the snapshot are in its changed freemap blocks
+	for(int k=0;(k < fm_copy_cnt) && (fm_committing_cnt > 0);k++)
 	{
-		if (!inodes[i].used)  // is inode free ?
+		int lo = fm_copy_blks[k] * MAX_FREEMAP_ID;
+		for(int i=lo;(i < lo + MAX_FREEMAP_ID) && (i < words);i++) 
 		{
-			memset(&inodes[i], 0, sizeof(inodes[i]));
-			memset(&inodes[i].blocks[0], BLOCK_FREE, sizeof(inodes[i].blocks));
-			inodes[i].next = BLOCK_FREE;
-			inodes[i].used = 1; // allocates inode
-			return i;
+			if (!fm_committing[i]) continue;
+			fm_committing[i] = 0;
+			fm_set_full(i, fm_used(i) == 0xffffffff);
+			if (i < fm_hint) fm_hint = i;
 		}
 	}
-	return -1; // inodes is full
+	freemap_freeblocks += fm_committing_cnt;
+	fm_committing_cnt = 0;
+	pthread_mutex_unlock(&fm_lock);
+}
+
+// returns one free block or BLOCK_FREE if disk is full
+block_t b_alloc_one()
+{
+	block_t b;
+	if (b_alloc(&b, 1) < 0) return BLOCK_FREE;
+	return b;
+}
+
+// empty file record
+static void i_clear_rec(INode *ip)
+{
+	memset(ip, 0, sizeof(*ip));
+	if (sblock.version != SFS_VERSION_BLKPTR) {
+		e_init(&ip->map.ext);
+	}
+	else {
+		memset(&ip->map.ptr.blocks[0], BLOCK_FREE, sizeof(ip->map.ptr.blocks));
+		ip->map.ptr.next = BLOCK_FREE;
+	}
+}
+
+int i_format()
+{
+	// inode table is written by chunks of empty records
+	INode chunk[ALLOC_CHUNK * INODES_PER_BLOCK];
+	for(int i=0;i < ALLOC_CHUNK * INODES_PER_BLOCK;i++) i_clear_rec(&chunk[i]);
+
+	for(int blk=0;blk < sblock.inodeBlks;blk += ALLOC_CHUNK)
+	{
+		int n = sblock.inodeBlks - blk;
+		if (n > ALLOC_CHUNK) n = ALLOC_CHUNK;
+
+		// root directory is used
+		int root_blk = sblock.inodeRoot / INODES_PER_BLOCK;
+		int with_root = (root_blk >= blk) && (root_blk < blk + n);
+		if (with_root) chunk[sblock.inodeRoot - blk * INODES_PER_BLOCK].used = 1;
+		int ret = write_blocks(1 + blk, n, chunk);
+		if (with_root) chunk[sblock.inodeRoot - blk * INODES_PER_BLOCK].used = 0;
+		if ((ret < 0) || (ret != n)) return -1; // error
+	}
+	return 0;
+}
+
+void i_clear(inode_t inode)
+{
+	i_gen_bump(inode);
+	i_chain_reset(inode);
+	i_clear_rec(i_rec(inode));
+	i_mem(inode)->used = 0;
+	i_mem(inode)->size = 0;
+}
+
+// returns first free entry
+inode_t i_alloc()
+{
+	inode_t i = im_alloc();
+	if (i < 0) return -1; // inodes is full
+	if (i_get(i) < 0) {
+		im_free(i);
+		return -1; // error
+	}
+
+	i_clear(i);
+	i_mem(i)->used = 1; // allocates inode
+	int ret = i_update(i);
+	i_put(i);
+	if (ret < 0) {
+		im_free(i);
+		return -1; // error
+	}
+	return i;
 }
 
 block_t i_getblk(inode_t inode, int blkid)
+{
+	return i_getrun(inode, blkid, 0);
+}
+
+block_t i_getrun(inode_t inode, int blkid, int *len)
 {
 	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
 
 	if (inode <= INODE_FREE) return -1; // not opened file
 	if (inode >= inode_cnt) return -1;
-	if (!inodes[inode].used) return -1; // invalid inode
+	INodeMem *im = i_mem(inode);
+	if (!im || !im->used) return -1; // invalid inode
+	if (blkid < 0) return -1; // error
 	
-	block_t *bp = inodes[inode].blocks;
-	int icnt = sizeof(inodes[inode].blocks) / sizeof(block_t);
+	if (sblock.version != SFS_VERSION_BLKPTR) return e_getrun(inode, blkid, len);
+	
+	INode *ip = i_rec(inode);
+	blkptr_t *bp = ip->map.ptr.blocks;
+	int icnt = sizeof(ip->map.ptr.blocks) / sizeof(blkptr_t);
 	int bptr = blkid;
 	
-	// checks prev blocks pointers block
-	if ((inode == last_inode) && (blkid >= inode_blocks_offset)) {
-		if (inode_blocks_offset >= icnt) {
-			bp = blocks;
-			icnt = BLKPTR_PER_BLOCK - 1;
-			bptr -= inode_blocks_offset;
+        // pointers block of chain, thread copy is used if it is still valid
+	if (bptr >= icnt) {
+		bptr -= icnt;
+		block_t pblk = i_chain(inode, bptr / BLKPTR_BLOCK_PTRS, 0);
+		bptr %= BLKPTR_BLOCK_PTRS;
+		if (pblk == BLOCK_FREE) {
+			// chain does not reach block - hole
+			if (len) *len = BLKPTR_BLOCK_PTRS - bptr;
+			return BLOCK_HOLE;
 		}
-	}
-	else {
-		// save current inode blocks block
-		last_inode = inode;
-		inode_blocks_offset = 0;
-		last_inode_block = -1;
+		if ((inode != last_inode) || (last_inode_gen != i_gen(inode)) || (pblk != last_inode_block)) {
+			last_inode = inode;
+			last_inode_gen = i_gen(inode);
+			last_inode_block = BLOCK_FREE;
+			if (bc_read(pblk + first_data_block, blocks) < 0) return -1; // error
+			last_inode_block = pblk;
+		}
+		bp = blocks;
+		icnt = BLKPTR_BLOCK_PTRS;
 	}
 	
-        // read next pointers blocks if need
-	while(bptr >= icnt) {
-		bptr -= icnt;
-		bp += icnt; // bp-> next block
-		inode_blocks_offset += icnt;
-		icnt = BLKPTR_PER_BLOCK - 1;
-		// read next inode blocks array
-		if (*bp == BLOCK_FREE) return -1; // error - block not found
-		last_inode_block = *bp;
-		int ret = read_blocks(*bp + first_data_block, 1, blocks);
-		if ((ret < 0) || (ret != 1)) return -1; // error
-		bp = blocks;
+	// following pointers of same pointers array continue the run or the hole
+	if (bp[bptr] == BLOCK_FREE) {
+		if (len) {
+			int n = 1;
+			while ((bptr + n < icnt) && (bp[bptr + n] == BLOCK_FREE)) n++;
+			*len = n;
+		}
+		return BLOCK_HOLE;
+	}
+	if (len) {
+		int n = 1;
+		while ((bptr + n < icnt) && (bp[bptr + n] == bp[bptr] + n)) n++;
+		*len = n;
 	}
 	
         // return absolute block number for given file offset
@@ -255,21 +797,51 @@ block_t i_getblk(inode_t inode, int blkid)
 	
 }
 
+int i_free_blocks(inode_t inode)
+{
+	if (sblock.version != SFS_VERSION_BLKPTR) return e_free(inode);
+
+	// free file data blocks of inode record, holes have no blocks
+	INode *ip = i_rec(inode);
+	int icnt = sizeof(ip->map.ptr.blocks) / sizeof(blkptr_t);
+	for(int i=0;i < icnt;i++) 
+	{
+		if ((ip->map.ptr.blocks[i] != BLOCK_FREE) && (b_free(ip->map.ptr.blocks[i]) < 0)) return -1; // error
+	}
+
+	// free file data blocks & pointers blocks of whole chain
+	blkptr_t pblocks[BLKPTR_PER_BLOCK];
+	block_t pblk;
+	for(int cid=0;(pblk = i_chain(inode, cid, 0)) != BLOCK_FREE;cid++) 
+	{
+		if (bc_read(pblk + first_data_block, pblocks) < 0) return -1; // error
+		for(int i=0;i < BLKPTR_BLOCK_PTRS;i++) 
+		{
+			if ((pblocks[i] != BLOCK_FREE) && (b_free(pblocks[i]) < 0)) return -1; // error
+		}
+		if (b_free(pblk) < 0) return -1; // error
+	}
+	i_chain_reset(inode);
+	i_gen_bump(inode);
+	return 0;
+}
+
 int i_read(inode_t inode, int offset, char* buf, int size)
 {
 	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
 
 	if (inode <= INODE_FREE) return 0; // not opened file
 	if (inode >= inode_cnt) return 0;
-	if (!inodes[inode].used) return 0; // invalid inode
+	INodeMem *im = i_mem(inode);
+	if (!im || !im->used) return 0; // invalid inode
 	if (offset < 0) return 0; // error
 	if (size <= 0) return 0; // error
 	if (!buf) return 0; // error
 	
 	// correct size to read if param size is greater then rest of file
-	if ((offset + size) > inodes[inode].size) 
+	if ((offset + size) > im->size) 
 	{
-		size -= ((offset + size) - inodes[inode].size);
+		size -= ((offset + size) - im->size);
 	}
 	if (size <= 0) return 0; // error
 	
@@ -278,175 +850,347 @@ int i_read(inode_t inode, int offset, char* buf, int size)
         // first reading block number
 	int first_block = offset / BLOCK_SIZE;
 	
-        // calc full number blocks to read
-	int readblocks = size;
-	if (first_block_bytes > 0) 
-	{
-		readblocks -= (BLOCK_SIZE - first_block_bytes);
-	}
-	readblocks = (readblocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if (first_block_bytes > 0) readblocks++;
-
-        // allocates buffer for data
-	int blksize = readblocks * BLOCK_SIZE;
-	byte_t *data = malloc(blksize);
-	if (!data) return 0; // memory full
-
-	// read file blocks
-	int rest = readblocks;
-	block_t blk = i_getblk(inode, first_block);
-	if (blk < 0) {
-		free(data);
-		return 0; // error
-	}
-	int curblk = 0;
-	while(rest > 0) {
-		int ret = read_blocks(blk, 1, &data[curblk * BLOCK_SIZE]);
-		if ((ret < 0) || (ret != 1)) {
-			free(data);
-			return 0; // error
-		}
-		curblk++;
-		rest--;
-		
-                // next block ?
-		if (rest > 0) {
-			blk = i_getblk(inode, first_block+curblk);
-			if (blk < 0) {
-				free(data);
-				return 0; // error
-			}
+	int last_block = (offset + size - 1) / BLOCK_SIZE;
+	int last_block_bytes = (offset + size) % BLOCK_SIZE;
+
+	// partially read first and last blocks go to scratch buffers, full blocks to user buffer
+	int head = (first_block_bytes > 0) || ((first_block == last_block) && (last_block_bytes > 0));
+	int tail = (first_block != last_block) && (last_block_bytes > 0);
+	char head_data[BLOCK_SIZE];
+	char tail_data[BLOCK_SIZE];
+
+	// read file blocks, physically contiguous runs go as one request, holes are zeros
+	IOBatch io;
+	io.nvec = 0;
+	io.write = 0;
+	for(int curblk = first_block;curblk <= last_block;) 
+	{
+		int run;
+		block_t blk = i_getrun(inode, curblk, &run);
+		if ((blk < 0) && (blk != BLOCK_HOLE)) return 0; // error
+		if (run > last_block - curblk + 1) run = last_block - curblk + 1;
+
+		for(int i=0;i < run;i++,curblk++)
+		{
+			char *bufptr;
+			if (head && (curblk == first_block)) bufptr = head_data;
+			else if (tail && (curblk == last_block)) bufptr = tail_data;
+			else bufptr = &buf[curblk * BLOCK_SIZE - offset];
+
+			if (blk == BLOCK_HOLE) memset(bufptr, 0, BLOCK_SIZE);
+			else if (io_add(&io, blk + i, 1, bufptr) < 0) return 0; // error
 		}
 	}
+	if (io_flush(&io) < 0) return 0; // error
 	
-	// copy data to user buffer
-	memcpy(buf, &data[first_block_bytes], size);
+	// copy partial blocks to user buffer
+	if (head) 
+	{
+		int first_read_bytes = BLOCK_SIZE - first_block_bytes;
+		if (first_read_bytes > size) first_read_bytes = size;
+		memcpy(buf, &head_data[first_block_bytes], first_read_bytes);
+	}
+	if (tail) 
+	{
+		memcpy(&buf[size - last_block_bytes], tail_data, last_block_bytes);
+	}
 
-	free(data);
 	return size;
 }
 
 
+int i_holes(inode_t inode, int first, int last)
+{
+	int cnt = 0;
+	for(int cur = first;cur <= last;) 
+	{
+		int run;
+		block_t blk = i_getrun(inode, cur, &run);
+		if ((blk < 0) && (blk != BLOCK_HOLE)) return -1; // error
+		if (run > last - cur + 1) run = last - cur + 1;
+		if (blk == BLOCK_HOLE) cnt += run;
+		cur += run;
+	}
+	return cnt;
+}
+
+// allocates blocks for holes of file blocks first..last
+static int i_fill(inode_t inode, int first, int last)
+{
+	// extents map allocates contiguous runs
+	if (sblock.version != SFS_VERSION_BLKPTR) return e_fill(inode, first, last);
+
+	// check disk full condition
+	int total_new_blks_cnt = i_holes(inode, first, last);
+	if (total_new_blks_cnt < 0) return -1; // error
+	if (total_new_blks_cnt == 0) return 0; // blocks are already allocated
+	// + new inode ptr blocks, chain is extended up to block of last
+	int icnt = sizeof(i_rec(inode)->map.ptr.blocks) / sizeof(blkptr_t);
+	for(int cid = (last - icnt) / (int)BLKPTR_BLOCK_PTRS;(last >= icnt) && (cid >= 0) && (i_chain(inode, cid, 0) == BLOCK_FREE);cid--) total_new_blks_cnt++;
+	if (total_new_blks_cnt > b_freecount()) return -1; // error - disk full
+	
+	// allocate blocks by chunks, blocks mapped before an error stay allocated
+	block_t new_blocks[ALLOC_CHUNK];
+	for(int cur = first;cur <= last;) 
+	{
+		int run;
+		block_t blk = i_getrun(inode, cur, &run);
+		if (run > last - cur + 1) run = last - cur + 1;
+		if (blk >= 0) {
+			cur += run;
+			continue;
+		}
+		if (blk != BLOCK_HOLE) return -1; // error
+
+		int n = (run < ALLOC_CHUNK) ? run : ALLOC_CHUNK;
+		if (b_alloc(new_blocks, n) < 0) return -1; // error - disk full
+		if (i_append_blocks(inode, cur, new_blocks, n) < 0) return -1; // error
+		cur += n;
+	}
+	return 0;
+}
+
+// writes zeros to data blocks of file blocks first..last, holes stay holes
+static int i_zero_blocks(inode_t inode, int first, int last)
+{
+	char zero_data[BLOCK_SIZE];
+	memset(zero_data, 0, BLOCK_SIZE);
+	IOBatch io;
+	io.nvec = 0;
+	io.write = 1;
+
+	for(int curblk = first;curblk <= last;)
+	{
+		int run;
+		block_t blk = i_getrun(inode, curblk, &run);
+		if ((blk < 0) && (blk != BLOCK_HOLE)) return -1; // error
+		if (run > last - curblk + 1) run = last - curblk + 1;
+		for(int i=0;(blk >= 0) && (i < run);i++)
+		{
+			if (io_add(&io, blk + i, 1, zero_data) < 0) return -1; // error
+		}
+		curblk += run;
+	}
+	return io_flush(&io);
+}
+
+// file bytes from old end of file from up to file block tblk read as zeros
+// blocks past end of file may keep data of writes which failed or be preallocated
+static int i_zero_gap(inode_t inode, int from, int tblk)
+{
+	// rest of last block of file
+	int curblk = from / BLOCK_SIZE;
+	if ((from % BLOCK_SIZE) && (curblk < tblk)) 
+	{
+		char last_data[BLOCK_SIZE];
+		block_t blk = i_getblk(inode, curblk);
+		if (blk >= 0) {
+			// data block - goes around the journal like the rest of file data
+			IOBatch io;
+			io.nvec = 0;
+			io.write = 0;
+			if ((io_add(&io, blk, 1, last_data) < 0) || (io_flush(&io) < 0)) return -1; // error
+			memset(&last_data[from % BLOCK_SIZE], 0, BLOCK_SIZE - from % BLOCK_SIZE);
+			io.write = 1;
+			if ((io_add(&io, blk, 1, last_data) < 0) || (io_flush(&io) < 0)) return -1; // error
+		}
+		else if (blk != BLOCK_HOLE) return -1; // error
+		curblk++;
+	}
+
+	// blocks mapped past end of file
+	return i_zero_blocks(inode, curblk, tblk - 1);
+}
+
 int i_write(inode_t inode, int offset, const char* buf, int size)
 {
 	int inode_cnt = sblock.inodeBlks * INODES_PER_BLOCK;
 
 	if (inode <= INODE_FREE) return 0; // not opened file
 	if (inode >= inode_cnt) return 0;
-	if (!inodes[inode].used) return 0; // invalid inode
+	INodeMem *im = i_mem(inode);
+	if (!im || !im->used) return 0; // invalid inode
 	if (offset < 0) return 0; // error
 	if (size <= 0) return 0; // error
+	if (offset > INT_MAX - size) return 0; // error - past max file size
 	if (!buf) return 0; // error
 	
-	// allocate new blocks for the inode according to size
-	int new_fsize = offset + size;
-	if (new_fsize > inodes[inode].size) 
-	{
-		int old_fblks = (inodes[inode].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		int new_fblks = (new_fsize + BLOCK_SIZE - 1) / BLOCK_SIZE;
-		int new_fblks_cnt = new_fblks - old_fblks;
-
-		// check disk full condition
-		int total_new_blks_cnt = new_fblks_cnt;
-		// + new inode ptr blocks
-		int icnt = sizeof(inodes[inode].blocks) / sizeof(block_t);
-		int obs = (max(0, old_fblks - icnt) + BLKPTR_PER_BLOCK - 2) / (BLKPTR_PER_BLOCK - 1);
-		int nbs = (max(0, new_fblks - icnt) + BLKPTR_PER_BLOCK - 2) / (BLKPTR_PER_BLOCK - 1);
-		total_new_blks_cnt += (nbs - obs);
-		if (total_new_blks_cnt > freemap_freeblocks) return 0; // error - disk full
-		
-		// allocate blocks
-		if (total_new_blks_cnt > 0)
-		{
-			block_t *new_blocks = b_alloc(new_fblks_cnt);
-			if (!new_blocks) return 0; // error - disk full
+	int first_block_bytes = offset % BLOCK_SIZE;
+	int first_block = offset / BLOCK_SIZE;
+	int last_block = (offset + size - 1) / BLOCK_SIZE;
+	int last_block_bytes = (offset + size) % BLOCK_SIZE;
+	int old_size = im->size;
+	int old_fblks = (old_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-			if (fm_update() < 0) {
-				free(new_blocks);
-				return 0; // error
-			}
-			if (i_append_blocks(inode, new_blocks, new_fblks_cnt) < 0) {
-				free(new_blocks);
-				return 0; // error
-			}
-			free(new_blocks);
-		}
-		
+	// first and last blocks are partially written - read them unless they are new
+	int head = (first_block_bytes > 0) || ((first_block == last_block) && (last_block_bytes > 0));
+	int tail = (first_block != last_block) && (last_block_bytes > 0);
+	int head_new = head && ((first_block >= old_fblks) || (i_getblk(inode, first_block) == BLOCK_HOLE));
+	int tail_new = tail && ((last_block >= old_fblks) || (i_getblk(inode, last_block) == BLOCK_HOLE));
+
+	// bytes skipped past end of file are zeros, only blocks written now are allocated
+	if ((offset > old_size) && (i_zero_gap(inode, old_size, first_block) < 0)) return 0; // error
+	if (i_fill(inode, first_block, last_block) < 0) return 0; // error - disk full
+	int new_fsize = offset + size;
+	if (new_fsize > old_size) 
+	{
 		// update size
-		inodes[inode].size = new_fsize;
+		im->size = new_fsize;
 		if (i_update(inode) < 0) return 0;
 	}
 
-	// write data to inode blocks
-	int first_block_bytes = offset % BLOCK_SIZE;
-	int first_block = offset / BLOCK_SIZE;
-	int first_write_bytes = BLOCK_SIZE - first_block_bytes;
-	
-	int writeblocks = size;
-	if (first_block_bytes > 0) writeblocks -= first_write_bytes;
-	writeblocks = (writeblocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
-	if (first_block_bytes > 0) writeblocks++;
-
-	// write file blocks
-	int rest = writeblocks;
-	int rest_bytes = size;
-
-	// read first block if needs
-	int ret;
+	char head_data[BLOCK_SIZE];
+	char tail_data[BLOCK_SIZE];
 	block_t blk;
-	char data[BLOCK_SIZE];
-	char* bufptr = (char*)buf;
-	int curblk = 0;
+	IOBatch io;
+	io.nvec = 0;
+	io.write = 0;
 	
-        // write first block
-	if (first_block_bytes > 0) 
+	if (head_new) memset(head_data, 0, BLOCK_SIZE);
+	else if (head) 
 	{
 		blk = i_getblk(inode, first_block);
+		if ((blk < 0) || (io_add(&io, blk, 1, head_data) < 0)) return 0; // error
+	}
+	if (tail_new) memset(tail_data, 0, BLOCK_SIZE);
+	else if (tail) 
+	{
+		blk = i_getblk(inode, last_block);
+		if ((blk < 0) || (io_add(&io, blk, 1, tail_data) < 0)) return 0; // error
+	}
+	if (io_flush(&io) < 0) return 0; // error
+	// rest of old last block up to offset
+	if (head && !head_new && (offset > old_size) && (first_block == old_fblks - 1)) {
+		memset(&head_data[old_size % BLOCK_SIZE], 0, offset - old_size);
+	}
+	
+	if (head) 
+	{
+		int first_write_bytes = BLOCK_SIZE - first_block_bytes;
+		if (first_write_bytes > size) first_write_bytes = size;
+		memcpy(&head_data[first_block_bytes], buf, first_write_bytes);
+	}
+	if (tail) 
+	{
+		memcpy(tail_data, &buf[size - last_block_bytes], last_block_bytes);
+	}
+
+	// write file blocks, full blocks go straight from user buffer
+	io.write = 1;
+	for(int curblk = first_block;curblk <= last_block;) 
+	{
+		int run;
+		blk = i_getrun(inode, curblk, &run);
 		if (blk < 0) return 0; // error
+		if (run > last_block - curblk + 1) run = last_block - curblk + 1;
 
-		ret = read_blocks(blk, 1, data);
-		if ((ret < 0) || (ret != 1)) return 0; // error
+		for(int i=0;i < run;i++,curblk++)
+		{
+			char *bufptr;
+			if (head && (curblk == first_block)) bufptr = head_data;
+			else if (tail && (curblk == last_block)) bufptr = tail_data;
+			else bufptr = (char *)&buf[curblk * BLOCK_SIZE - offset];
 
-		// prepare block
-		memcpy(&data[first_block_bytes], buf, first_write_bytes);
-		
-		// save block
-		ret = write_blocks(blk, 1, data);
-		if ((ret < 0) || (ret != 1)) return -1; // error
-		
-		rest--;
-		rest_bytes -= first_write_bytes;
-		bufptr += first_write_bytes;
-		curblk++;
+			if (io_add(&io, blk + i, 1, bufptr) < 0) return 0; // error
+		}
 	}
+	if (io_flush(&io) < 0) return 0; // error
 
-        // write next blocks
-	while(rest > 0) {
-		blk = i_getblk(inode, first_block+curblk);
-		if (blk < 0) return 0; // error
-		
-		int to_write = rest_bytes;
-		if (to_write > BLOCK_SIZE) to_write = BLOCK_SIZE;
+	return size;
+}
 
-		// read & prepare last block if needs
-		if (to_write < BLOCK_SIZE) 
-		{
-			ret = read_blocks(blk, 1, data);
-			if ((ret < 0) || (ret != 1)) return 0; // error
+// frees data blocks of file blocks from fblks on and pointers blocks left without them
+static int i_free_tail(inode_t inode, int fblks)
+{
+	if (sblock.version != SFS_VERSION_BLKPTR) return e_truncate(inode, fblks);
 
-			// prepare block
-			memcpy(data, bufptr, to_write);
-			bufptr = data;
+	// pointers of inode record
+	INode *ip = i_rec(inode);
+	int icnt = sizeof(ip->map.ptr.blocks) / sizeof(blkptr_t);
+	int changed = 0;
+	for(int i=fblks;i < icnt;i++) 
+	{
+		if (ip->map.ptr.blocks[i] == BLOCK_FREE) continue;
+		if (b_free(ip->map.ptr.blocks[i]) < 0) return -1; // error
+		ip->map.ptr.blocks[i] = BLOCK_FREE;
+		changed = 1;
+	}
+
+	// chain blocks from the last one which stays, it keeps pointers before fblks
+	int keep = (fblks > icnt) ? (fblks - icnt + BLKPTR_BLOCK_PTRS - 1) / BLKPTR_BLOCK_PTRS : 0;
+	blkptr_t pblocks[BLKPTR_PER_BLOCK];
+	block_t pblk;
+	for(int cid=max(0, keep - 1);(pblk = i_chain(inode, cid, 0)) != BLOCK_FREE;cid++) 
+	{
+		if (bc_read(pblk + first_data_block, pblocks) < 0) return -1; // error
+		int dirty = 0;
+		for(int i=max(0, fblks - icnt - cid * (int)BLKPTR_BLOCK_PTRS);i < BLKPTR_BLOCK_PTRS;i++) 
+		{
+			if (pblocks[i] == BLOCK_FREE) continue;
+			if (b_free(pblocks[i]) < 0) return -1; // error
+			pblocks[i] = BLOCK_FREE;
+			dirty = 1;
 		}
+		if (cid >= keep) {
+			if (b_free(pblk) < 0) return -1; // error
+		}
+		else if (dirty || (pblocks[BLKPTR_BLOCK_PTRS] != BLOCK_FREE)) {
+			pblocks[BLKPTR_BLOCK_PTRS] = BLOCK_FREE;
+			if (bc_write(pblk + first_data_block, pblocks) < 0) return -1; // error
+		}
+		changed = 1;
+	}
+	if (keep == 0) ip->map.ptr.next = BLOCK_FREE;
 
-		ret = write_blocks(blk, 1, bufptr);
-		if ((ret < 0) || (ret != 1)) return 0; // error
-		
-		rest_bytes -= to_write;
-		bufptr += to_write;
-		curblk++;
-		rest--;
+	if (changed) {
+		// pointers block copies of threads are stale
+		i_chain_reset(inode);
+		i_gen_bump(inode);
 	}
+	return 0;
+}
 
-	return size;
+int i_truncate(inode_t inode, int size)
+{
+	INodeMem *im = i_mem(inode);
+	if (!im || !im->used) return -1; // invalid inode
+	if (size < 0) return -1; // error
+
+	// new bytes are a hole, blocks past new end of file are freed
+	int fblks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if ((size > im->size) && (i_zero_gap(inode, im->size, fblks) < 0)) return -1; // error
+	if (i_free_tail(inode, fblks) < 0) return -1; // error
+
+	im->size = size;
+	return i_update(inode);
+}
+
+int i_fallocate(inode_t inode, int offset, int len)
+{
+	INodeMem *im = i_mem(inode);
+	if (!im || !im->used) return -1; // invalid inode
+	if ((offset < 0) || (len <= 0) || (offset > INT_MAX - len)) return -1; // error
+
+	int first = offset / BLOCK_SIZE;
+	int last = (offset + len - 1) / BLOCK_SIZE;
+	int fblks = (im->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// holes inside file read as zeros, blocks allocated for them are cleared
+	for(int cur = first;(cur <= last) && (cur < fblks);) 
+	{
+		int run;
+		block_t blk = i_getrun(inode, cur, &run);
+		if ((blk < 0) && (blk != BLOCK_HOLE)) return -1; // error
+		if (run > fblks - cur) run = fblks - cur;
+		if (run > last - cur + 1) run = last - cur + 1;
+		if (blk == BLOCK_HOLE) {
+			if (i_fill(inode, cur, cur + run - 1) < 0) return -1; // error - disk full
+			if (i_zero_blocks(inode, cur, cur + run - 1) < 0) return -1; // error
+		}
+		cur += run;
+	}
+
+	// blocks past end of file are not read before they are written
+	if ((last >= fblks) && (i_fill(inode, (first > fblks) ? first : fblks, last) < 0)) return -1; // error - disk full
+	return 0;
 }
@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "disk_emu.h"
+#include "sfs.h"
+
+
+// home block numbers in one descriptor block
+#define JOURNAL_DESC_BLOCKS		(BLOCK_SIZE / sizeof(int))
+
+// journal region: header block, descriptor blocks, then blocks of last transaction
+static int j_start = 0;			// absolute block of journal header
+static int j_blocks = 0;		// blocks in journal region, 0 if there is no journal
+static int j_seq = 0;			// number of last written transaction
+static int j_max = 0;			// max blocks in transaction
+// header & descriptor blocks, list of home blocks continues from header to descriptors
+static JournalHeader *j_hdr = 0;
+static blkvec_t *j_vec = 0;
+
+// home blocks list, addressed through the whole header & descriptors area
+static int *j_list(const JournalHeader *jh)
+{
+	return (int *)((byte_t *)jh + offsetof(JournalHeader, blocks));
+}
+
+// descriptor blocks for transaction of cnt blocks
+static int j_desc(int cnt)
+{
+	if (cnt <= (int)JOURNAL_MAX_BLOCKS) return 0;
+	return (cnt - JOURNAL_MAX_BLOCKS + JOURNAL_DESC_BLOCKS - 1) / JOURNAL_DESC_BLOCKS;
+}
+
+// FNV-1a hash of transaction
+static unsigned int j_checksum(const JournalHeader *jh, const blkvec_t *vec, int cnt)
+{
+	unsigned int h = 2166136261u;
+	const byte_t *p = (const byte_t *)j_list(jh);
+	for (int i = 0; i < cnt * (int)sizeof(int); i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	for (int k = 0; k < cnt; k++)
+	{
+		p = (const byte_t *)vec[k].buffer;
+		for (int i = 0; i < BLOCK_SIZE; i++) {
+			h ^= p[i];
+			h *= 16777619u;
+		}
+	}
+	return h ^ (unsigned int)jh->seq ^ (unsigned int)cnt;
+}
+
+int j_size(int cnt)
+{
+	return 1 + j_desc(cnt) + cnt;
+}
+
+int j_init(int start, int nblocks)
+{
+	j_start = start;
+	j_blocks = nblocks;
+	j_seq = 0;
+
+	// largest transaction which fits with its descriptors
+	j_max = nblocks - 1;
+	while ((j_max > 0) && (j_size(j_max) > nblocks)) j_max--;
+	if (j_max < 0) j_max = 0;
+
+	free(j_hdr);
+	free(j_vec);
+	j_hdr = 0;
+	j_vec = 0;
+	if (!j_enabled()) return 0;
+
+	j_hdr = malloc((1 + j_desc(j_max)) * BLOCK_SIZE);
+	j_vec = malloc((2 + j_max) * sizeof(blkvec_t));
+	if (!j_hdr || !j_vec) return -1; // memory full
+	return 0;
+}
+
+int j_enabled()
+{
+	return j_blocks > 0;
+}
+
+int j_max_blocks()
+{
+	return j_max;
+}
+
+int j_format()
+{
+	if (!j_enabled()) return 0;
+
+	memset(j_hdr, 0, BLOCK_SIZE);
+	int ret = write_blocks(j_start, 1, j_hdr);
+	if ((ret < 0) || (ret != 1)) return -1; // error
+	return 0;
+}
+
+int j_write(const blkvec_t *vec, int cnt)
+{
+	if (cnt <= 0) return 0;
+	if (cnt > j_max_blocks()) return -1; // error - transaction is too big
+
+	// header is valid only together with all blocks it describes
+	int hdr_blocks = 1 + j_desc(cnt);
+	JournalHeader *jh = j_hdr;
+	memset(jh, 0, hdr_blocks * BLOCK_SIZE);
+	jh->magic = JOURNAL_MAGIC;
+	jh->seq = ++j_seq;
+	jh->count = cnt;
+	int *list = j_list(jh);
+	for (int i = 0; i < cnt; i++) list[i] = vec[i].start_address;
+	jh->checksum = j_checksum(jh, vec, cnt);
+
+	// header, descriptors and blocks copies go as one request
+	j_vec[0].start_address = j_start;
+	j_vec[0].nblocks = hdr_blocks;
+	j_vec[0].buffer = jh;
+	for (int i = 0; i < cnt; i++)
+	{
+		j_vec[i+1].start_address = j_start + hdr_blocks + i;
+		j_vec[i+1].nblocks = 1;
+		j_vec[i+1].buffer = vec[i].buffer;
+	}
+	int ret = write_blocks_v(j_vec, cnt + 1);
+	if ((ret < 0) || (ret != cnt + hdr_blocks)) return -1; // error
+
+	// transaction is committed when it is on disk
+	if (sync_disk() < 0) return -1; // error
+	return 0;
+}
+
+int j_checkpoint()
+{
+	if (!j_enabled()) return 0;
+
+	// header without blocks keeps transaction number only
+	JournalHeader *jh = j_hdr;
+	memset(jh, 0, BLOCK_SIZE);
+	jh->magic = JOURNAL_MAGIC;
+	jh->seq = j_seq;
+	jh->count = 0;
+	int ret = write_blocks(j_start, 1, jh);
+	if ((ret < 0) || (ret != 1)) return -1; // error
+
+	// old transaction must not come back over blocks reused after it
+	if (sync_disk() < 0) return -1; // error
+	return 0;
+}
+
+int j_replay()
+{
+	if (!j_enabled()) return 0;
+
+	JournalHeader *jh = j_hdr;
+	int ret = read_blocks(j_start, 1, jh);
+	if ((ret < 0) || (ret != 1)) return -1; // error
+	if (jh->magic != JOURNAL_MAGIC) return 0; // empty journal
+	j_seq = jh->seq;
+	if (jh->count == 0) return 0; // checkpointed - home blocks are up to date
+	if ((jh->count < 0) || (jh->count > j_max_blocks())) return 0; // broken header - nothing to replay
+
+	// rest of home blocks list
+	int cnt = jh->count;
+	int hdr_blocks = 1 + j_desc(cnt);
+	if (hdr_blocks > 1) {
+		ret = read_blocks(j_start + 1, hdr_blocks - 1, (byte_t *)jh + BLOCK_SIZE);
+		if ((ret < 0) || (ret != hdr_blocks - 1)) return -1; // error
+	}
+
+	// read copies of transaction blocks
+	byte_t *data = malloc((size_t)cnt * BLOCK_SIZE);
+	if (!data) return -1; // memory full
+	ret = read_blocks(j_start + hdr_blocks, cnt, data);
+	if ((ret < 0) || (ret != cnt)) {
+		free(data);
+		return -1; // error
+	}
+
+	blkvec_t *vec = j_vec;
+	int *list = j_list(jh);
+	for (int i = 0; i < cnt; i++)
+	{
+		vec[i].start_address = list[i];
+		vec[i].nblocks = 1;
+		vec[i].buffer = &data[i * BLOCK_SIZE];
+	}
+
+	// torn transaction was never committed - home blocks are still consistent
+	if (j_checksum(jh, vec, cnt) != jh->checksum) {
+		free(data);
+		return 0;
+	}
+
+	// write blocks home again, replay of an applied transaction changes nothing
+	ret = write_blocks_v(vec, cnt);
+	free(data);
+	if ((ret < 0) || (ret != cnt)) return -1; // error
+	if (sync_disk() < 0) return -1; // error
+	return j_checkpoint();
+}
@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "sfs.h"
+
+
+// readahead window in blocks, it starts small and doubles while reads stay sequential
+#define RA_MIN_BLOCKS	4
+#define RA_MAX_BLOCKS	64
+
+// readahead state of descriptors may be used by several readers of the same descriptor
+static pthread_mutex_t ra_locks[MAX_FD];
+static pthread_once_t ra_once = PTHREAD_ONCE_INIT;
+
+static void ra_init_locks()
+{
+	for(int fd=0;fd < MAX_FD;fd++) pthread_mutex_init(&ra_locks[fd], 0);
+}
+
+
+void ra_reset(int fd)
+{
+	pthread_once(&ra_once, ra_init_locks);
+	pthread_mutex_lock(&ra_locks[fd]);
+	ofdt[fd].ra_next = -1;
+	ofdt[fd].ra_window = 0;
+	ofdt[fd].ra_len = 0;
+	pthread_mutex_unlock(&ra_locks[fd]);
+}
+
+// copies bytes of readahead buffer, returns 0 if they are not buffered
+static int ra_copy(FileDesc *f, char *buf, int size, int pos)
+{
+	if (f->ra_len <= 0) return 0;
+	if ((pos < f->ra_start) || (pos + size > f->ra_start + f->ra_len)) return 0;
+	memcpy(buf, &f->ra_buf[pos - f->ra_start], size);
+	return size;
+}
+
+int ra_read(int fd, char *buf, int size, int pos)
+{
+	FileDesc *f = &ofdt[fd];
+	if ((size <= 0) || (pos < 0)) return i_read(f->inode, pos, buf, size);
+
+	pthread_once(&ra_once, ra_init_locks);
+	pthread_mutex_lock(&ra_locks[fd]);
+
+	// read continuing the previous one grows the window, other reads drop it
+	if (pos == f->ra_next) {
+		f->ra_window = f->ra_window ? f->ra_window * 2 : RA_MIN_BLOCKS;
+		if (f->ra_window > RA_MAX_BLOCKS) f->ra_window = RA_MAX_BLOCKS;
+	}
+	else {
+		f->ra_window = 0;
+		f->ra_len = 0;
+	}
+
+	int ret = ra_copy(f, buf, size, pos);
+	if (!ret) {
+		// buffer gets window of blocks from block of pos, request bigger than buffer goes directly
+		int first = (pos / BLOCK_SIZE) * BLOCK_SIZE;
+		int len = f->ra_window * BLOCK_SIZE;
+		if (!f->ra_buf) f->ra_buf = malloc(RA_MAX_BLOCKS * BLOCK_SIZE);
+		if (!f->ra_window || !f->ra_buf || (pos + size > first + len)) {
+			f->ra_len = 0;
+			ret = i_read(f->inode, pos, buf, size);
+		}
+		else {
+			f->ra_start = first;
+			f->ra_len = i_read(f->inode, first, f->ra_buf, len);
+			ret = ra_copy(f, buf, size, pos);
+			// end of file is in buffer
+			if (!ret && (f->ra_len > pos - first)) ret = ra_copy(f, buf, f->ra_start + f->ra_len - pos, pos);
+		}
+	}
+	f->ra_next = (ret > 0) ? pos + ret : -1;
+
+	pthread_mutex_unlock(&ra_locks[fd]);
+	return ret;
+}
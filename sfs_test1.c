@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "sfs_api.h"
 
@@ -76,6 +77,8 @@ main(int argc, char **argv)
   int ncreate;                  /* Number of files created in directory */
   int error_count = 0;
   int tmp;
+  char *gapname;                /* File written past its end */
+  int gapfd;
 
   mksfs(1);                     /* Initialize the file system. */
 
@@ -314,6 +317,98 @@ main(int argc, char **argv)
     }
   }
 
+  /* Positioned reads and writes, the file position must not move.
+   */
+  fds[0] = sfs_fopen(names[0]);
+  sfs_fseek(fds[0], 0);
+  tmp = sfs_pwrite(fds[0], "XYZ", 3, 4);
+  if (tmp != 3) {
+    fprintf(stderr, "ERROR: Tried to pwrite 3 bytes, returned %d\n", tmp);
+    error_count++;
+  }
+  readsize = sfs_pread(fds[0], fixedbuf, 5, 2);
+  if (readsize != 5 || memcmp(fixedbuf, "e XYZ", 5) != 0) {
+    fprintf(stderr, "ERROR: pread at offset 2 returned %d bytes, wrong data\n", readsize);
+    error_count++;
+  }
+  readsize = sfs_fread(fds[0], fixedbuf, 4);
+  if (readsize != 4 || memcmp(fixedbuf, test_str, 4) != 0) {
+    fprintf(stderr, "ERROR: pread/pwrite moved the file position\n");
+    error_count++;
+  }
+  /* Short read at end of file, nothing past it */
+  readsize = sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), strlen(test_str) - 5);
+  if (readsize != 5 || memcmp(fixedbuf, &test_str[strlen(test_str) - 5], 5) != 0) {
+    fprintf(stderr, "ERROR: pread at end of file returned %d bytes, expected 5\n", readsize);
+    error_count++;
+  }
+  if (sfs_pread(fds[0], fixedbuf, sizeof(fixedbuf), strlen(test_str)) != 0) {
+    fprintf(stderr, "ERROR: pread past end of file returned data\n");
+    error_count++;
+  }
+  sfs_pwrite(fds[0], &test_str[4], 3, 4);
+  sfs_fclose(fds[0]);
+
+  /* Writes past end of file leave a gap which reads back as zeros.
+   */
+  gapname = rand_name();
+  gapfd = sfs_fopen(gapname);
+  sfs_fwrite(gapfd, test_str, 10);
+  sfs_fseek(gapfd, 5000);
+  tmp = sfs_fwrite(gapfd, test_str, 10);
+  if (tmp != 10) {
+    fprintf(stderr, "ERROR: write past end of file returned %d\n", tmp);
+    error_count++;
+  }
+  tmp = sfs_pwrite(gapfd, test_str, 10, 20000);
+  if (tmp != 10) {
+    fprintf(stderr, "ERROR: pwrite past end of file returned %d\n", tmp);
+    error_count++;
+  }
+  if (sfs_getfilesize(gapname) != 20010) {
+    fprintf(stderr, "ERROR: file with gaps has size %d, expected 20010\n",
+            sfs_getfilesize(gapname));
+    error_count++;
+  }
+  for (j = 0; j < 20010; j += readsize) {
+    readsize = sfs_pread(gapfd, fixedbuf, sizeof(fixedbuf), j);
+    if (readsize <= 0) {
+      fprintf(stderr, "ERROR: read of file with gaps failed at %d\n", j);
+      error_count++;
+      break;
+    }
+    for (k = 0; k < readsize; k++) {
+      char expect = 0;
+      if (j+k < 10) expect = test_str[j+k];
+      else if (j+k >= 5000 && j+k < 5010) expect = test_str[j+k-5000];
+      else if (j+k >= 20000) expect = test_str[j+k-20000];
+      if (fixedbuf[k] != expect) {
+        fprintf(stderr, "ERROR: wrong byte in file with gaps at %d (%d,%d)\n",
+                j+k, fixedbuf[k], expect);
+        error_count++;
+        break;
+      }
+    }
+  }
+
+  /* File positions are int, a write ending past INT_MAX must fail */
+  if (sfs_pwrite(gapfd, test_str, 10, INT_MAX - 5) != 0) {
+    fprintf(stderr, "ERROR: pwrite ending past INT_MAX succeeded\n");
+    error_count++;
+  }
+  sfs_fseek(gapfd, INT_MAX - 5);
+  if (sfs_fwrite(gapfd, test_str, 10) != 0) {
+    fprintf(stderr, "ERROR: write ending past INT_MAX succeeded\n");
+    error_count++;
+  }
+  if (sfs_getfilesize(gapname) != 20010) {
+    fprintf(stderr, "ERROR: failed write changed file size to %d\n",
+            sfs_getfilesize(gapname));
+    error_count++;
+  }
+  sfs_fclose(gapfd);
+  sfs_remove(gapname);
+
   printf("Trying to fill up the disk with repeated writes to %s.\n", names[0]);
   printf("(This may take a while).\n");
 
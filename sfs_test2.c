@@ -76,6 +76,11 @@ main(int argc, char **argv)
   int ncreate;                  /* Number of files created in directory */
   int error_count = 0;
   int tmp;
+  FILE *image;
+  char sbbuf[1024];
+  char *truncname;              /* File cut and grown again */
+  int truncfd;
+  int filled;
 
   mksfs(1);                     /* Initialize the file system. */
 
@@ -342,6 +347,111 @@ main(int argc, char **argv)
     }
   }
 
+  /* Truncate shrinks and grows a file, bytes added read as zeros.
+   */
+  truncname = rand_name();
+  truncfd = sfs_fopen(truncname);
+  for (k = 0; k < 3000; k++) {
+    fixedbuf[k % sizeof(fixedbuf)] = (char)(k * 7 + 1);
+    if (k % sizeof(fixedbuf) == sizeof(fixedbuf) - 1 || k == 2999) {
+      sfs_fwrite(truncfd, fixedbuf, k % sizeof(fixedbuf) + 1);
+    }
+  }
+  if (sfs_ftruncate(truncfd, 1500) != 0 || sfs_getfilesize(truncname) != 1500) {
+    fprintf(stderr, "ERROR: truncate to 1500 bytes gives size %d\n", sfs_getfilesize(truncname));
+    error_count++;
+  }
+  if (sfs_ftruncate(truncfd, 4000) != 0 || sfs_getfilesize(truncname) != 4000) {
+    fprintf(stderr, "ERROR: truncate to 4000 bytes gives size %d\n", sfs_getfilesize(truncname));
+    error_count++;
+  }
+  for (j = 0; j < 4000; j += readsize) {
+    readsize = sfs_pread(truncfd, fixedbuf, sizeof(fixedbuf), j);
+    if (readsize <= 0) {
+      fprintf(stderr, "ERROR: read of truncated file failed at %d\n", j);
+      error_count++;
+      break;
+    }
+    for (k = 0; k < readsize; k++) {
+      if (fixedbuf[k] != ((j+k < 1500) ? (char)((j+k) * 7 + 1) : 0)) {
+        fprintf(stderr, "ERROR: wrong byte in truncated file at %d (%d)\n", j+k, fixedbuf[k]);
+        error_count++;
+        break;
+      }
+    }
+  }
+  if (sfs_ftruncate(truncfd, 0) != 0 || sfs_getfilesize(truncname) != 0) {
+    fprintf(stderr, "ERROR: truncate to 0 bytes gives size %d\n", sfs_getfilesize(truncname));
+    error_count++;
+  }
+  if (sfs_pread(truncfd, fixedbuf, sizeof(fixedbuf), 0) != 0) {
+    fprintf(stderr, "ERROR: read data from empty file\n");
+    error_count++;
+  }
+
+  /* Blocks preallocated for a hole read as zeros, size is not changed */
+  if (sfs_ftruncate(truncfd, 2000) != 0 || sfs_fallocate(truncfd, 1000, 5000) != 0) {
+    fprintf(stderr, "ERROR: fallocate of hole failed\n");
+    error_count++;
+  }
+  if (sfs_getfilesize(truncname) != 2000) {
+    fprintf(stderr, "ERROR: fallocate changed size to %d\n", sfs_getfilesize(truncname));
+    error_count++;
+  }
+  sfs_ftruncate(truncfd, 6000);
+  for (j = 0; j < 6000; j += readsize) {
+    readsize = sfs_pread(truncfd, fixedbuf, sizeof(fixedbuf), j);
+    if (readsize <= 0) {
+      fprintf(stderr, "ERROR: read of preallocated file failed at %d\n", j);
+      error_count++;
+      break;
+    }
+    for (k = 0; k < readsize; k++) {
+      if (fixedbuf[k] != 0) {
+        fprintf(stderr, "ERROR: old data in preallocated file at %d (%d)\n", j+k, fixedbuf[k]);
+        error_count++;
+        break;
+      }
+    }
+  }
+  sfs_fclose(truncfd);
+  sfs_remove(truncname);
+
+  /* Mount of an image with a damaged superblock fails, later calls
+   * must report errors instead of crashing.
+   */
+  sfs_sync();
+  image = fopen("fs.sfs", "r+b");
+  if (image != NULL && fread(sbbuf, sizeof(sbbuf), 1, image) == 1) {
+    memset(fixedbuf, 0xff, sizeof(fixedbuf));
+    fseek(image, 0, SEEK_SET);
+    fwrite(fixedbuf, sizeof(fixedbuf), 1, image);
+    fflush(image);
+    mksfs(0);
+
+    if (sfs_fopen("DAMAGED.SB") >= 0) {
+      fprintf(stderr, "ERROR: created file on image with damaged superblock\n");
+      error_count++;
+    }
+    if (sfs_getnextfilename(fixedbuf)) {
+      fprintf(stderr, "ERROR: listed file on image with damaged superblock\n");
+      error_count++;
+    }
+
+    fseek(image, 0, SEEK_SET);
+    fwrite(sbbuf, sizeof(sbbuf), 1, image);
+    fclose(image);
+    mksfs(0);
+  }
+  else {
+    fprintf(stderr, "ERROR: can't open disk image\n");
+    error_count++;
+  }
+  if (sfs_getfilesize(names[0]) != strlen(test_str)) {
+    fprintf(stderr, "ERROR: image not mounted again after superblock was restored\n");
+    error_count++;
+  }
+
   printf("Trying to fill up the disk with repeated writes to %s.\n", names[0]);
   printf("(This may take a while).\n");
 
@@ -369,6 +479,21 @@ main(int argc, char **argv)
         break;
       }
     }
+
+    /* Truncate gives the blocks back, the same data fits again */
+    filled = i;
+    if (sfs_ftruncate(fds[0], strlen(test_str)) != 0) {
+      fprintf(stderr, "ERROR: truncate of full file failed\n");
+      error_count++;
+    }
+    sfs_fseek(fds[0], strlen(test_str));
+    for (i = 0; i < filled; i++) {
+      if (sfs_fwrite(fds[0], fixedbuf, sizeof(fixedbuf)) != sizeof(fixedbuf)) {
+        fprintf(stderr, "ERROR: only %d of %d blocks written again after truncate\n", i, filled);
+        error_count++;
+        break;
+      }
+    }
     sfs_fclose(fds[0]);
   }
   else {
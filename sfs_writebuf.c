@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "sfs.h"
+
+
+// write buffer of descriptor in blocks, it grows from WB_BLOCKS up to WB_MAX_BLOCKS
+#define WB_BLOCKS		64
+#define WB_MAX_BLOCKS	1024
+// free blocks kept for block map blocks, buffer is not used when disk is nearly full
+#define WB_RESERVE		8
+
+
+int wb_size(int fd)
+{
+	FileDesc *f = &ofdt[fd];
+	int size = i_mem(f->inode)->size;
+	if ((f->wb_len > 0) && (f->wb_pos + f->wb_len > size)) size = f->wb_pos + f->wb_len;
+	return size;
+}
+
+int wb_flush(int fd)
+{
+	FileDesc *f = &ofdt[fd];
+	if (f->wb_len <= 0) return 0;
+
+	// reserved blocks are allocated now - i_write counts them as free
+	int resv = f->wb_resv;
+	b_unreserve(resv);
+	f->wb_resv = 0;
+	ra_reset(fd);
+	int len = f->wb_len;
+	int ret = i_write(f->inode, f->wb_pos, f->wb_buf, len);
+	if (ret == len) {
+		f->wb_len = 0;
+		return 0;
+	}
+
+	// data stays buffered until it is in file, next flush retries what was not written
+	if (ret > 0) {
+		memmove(f->wb_buf, &f->wb_buf[ret], len - ret);
+		f->wb_pos += ret;
+		f->wb_len -= ret;
+	}
+	if (b_reserve(resv, 0) == 0) f->wb_resv = resv;
+	return -1; // error
+}
+
+void wb_release(int fd)
+{
+	FileDesc *f = &ofdt[fd];
+	b_unreserve(f->wb_resv);
+	f->wb_resv = 0;
+	f->wb_len = 0;
+	free(f->wb_buf);
+	f->wb_buf = 0;
+	f->wb_cap = 0;
+}
+
+// buffer has room for len bytes
+static int wb_grow(FileDesc *f, int len)
+{
+	if (len <= f->wb_cap) return 0;
+	if (len > WB_MAX_BLOCKS * BLOCK_SIZE) return -1; // error - too big
+
+	int cap = f->wb_cap ? f->wb_cap : WB_BLOCKS * BLOCK_SIZE;
+	while (cap < len) cap *= 2;
+	char *buf = realloc(f->wb_buf, cap);
+	if (!buf) return -1; // memory full
+	f->wb_buf = buf;
+	f->wb_cap = cap;
+	return 0;
+}
+
+int wb_write(int fd, const char *buf, int size, int pos)
+{
+	FileDesc *f = &ofdt[fd];
+	if ((size <= 0) || !buf) return 0; // error
+	if ((pos < 0) || (pos > INT_MAX - size)) return 0; // error - past max file size
+
+	// buffer continues at its end only
+	if ((f->wb_len > 0) && ((pos != f->wb_pos + f->wb_len) || (f->wb_len + size > WB_MAX_BLOCKS * BLOCK_SIZE))) {
+		if (wb_flush(fd) < 0) return 0; // error
+	}
+
+	// blocks the buffer gets now are reserved if they are past end of file or holes,
+	// so disk full is reported by the write which hits it
+	// writes which do not fit the buffer go directly
+	int fblks = (i_mem(f->inode)->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int first = (f->wb_len > 0) ? (pos + BLOCK_SIZE - 1) / BLOCK_SIZE : pos / BLOCK_SIZE;
+	int last = (pos + size - 1) / BLOCK_SIZE;
+	int need = (last >= fblks) ? last - ((first > fblks) ? first : fblks) + 1 : 0;
+	if (first < fblks) {
+		int holes = i_holes(f->inode, first, (last < fblks) ? last : fblks - 1);
+		if (holes < 0) return 0; // error
+		need += holes;
+	}
+	if ((wb_grow(f, f->wb_len + size) < 0) || ((need > 0) && (b_reserve(need, WB_RESERVE) < 0))) {
+		if (wb_flush(fd) < 0) return 0; // error
+		ra_reset(fd);
+		return i_write(f->inode, pos, buf, size);
+	}
+	if (need > 0) f->wb_resv += need;
+
+	if (f->wb_len == 0) f->wb_pos = pos;
+	memcpy(&f->wb_buf[f->wb_len], buf, size);
+	f->wb_len += size;
+	return size;
+}